@@ -5,6 +5,25 @@
 #include <linux/fs.h>          /* libfs stuff           */
 #include <linux/buffer_head.h> /* buffer_head           */
 #include <linux/slab.h>        /* kmem_cache            */
+#include <linux/pagemap.h>     /* caché de páginas      */
+#include <linux/mpage.h>       /* mpage_readahead       */
+#include <linux/parser.h>      /* opciones de montaje   */
+#include <linux/seq_file.h>    /* show_options          */
+#include <linux/workqueue.h>   /* delayed_work          */
+#include <linux/sort.h>        /* sort                  */
+#include <linux/crc32.h>       /* crc32 del diario      */
+#include <linux/iomap.h>       /* E/S directa           */
+#include <linux/blkdev.h>      /* blk_plug              */
+#include <linux/bio.h>         /* blk_next_bio          */
+#include <linux/falloc.h>      /* fallocate             */
+#include <linux/lz4.h>         /* clusters comprimidos  */
+#include <linux/log2.h>        /* is_power_of_2         */
+#include <linux/percpu.h>      /* estadísticas          */
+#include <linux/timekeeping.h> /* ktime_get_ns          */
+#include <linux/mount.h>       /* mnt_want_write_file   */
+#include <linux/xarray.h>      /* revocaciones al montar */
+#include <linux/sched/mm.h>    /* memalloc_nofs_save    */
+#include <crypto/hash.h>       /* crc32c de metadatos   */
 #include "assoofs.h"
 MODULE_LICENSE("GPL");
 /*
@@ -13,172 +32,5046 @@ MODULE_LICENSE("GPL");
 // Parte opcional B: Cache d inodos
 static struct kmem_cache *assoofs_inode_cache;
 
-// Parte opcional C: Bloqueo de superbloque y recursos compartidos
-static DEFINE_MUTEX(assoofs_sb_lock);
-static DEFINE_MUTEX(assoofs_storageInodos_lock);
+/*
+ * Información en memoria de cada sistema de ficheros montado (sb->s_fs_info).
+ * Las actualizaciones de metadatos van al diario: en modo síncrono (-o sync)
+ * cada operación espera a que su transacción esté confirmada; en modo
+ * asíncrono (por defecto) las transacciones se confirman en sync_fs/put_super
+ * o cada s_commit_interval segundos.
+ *
+ * Los contadores de s_as solo cambian en memoria (s_sb_dirty) y pasan al
+ * superbloque al confirmar la transacción en la que han cambiado, no en cada
+ * reserva o liberación.
+ *
+ * Bloqueos: s_lock protege los mapas de bits, los contadores de s_as y
+ * s_sb_dirty, las reservas de la asignación diferida, las estadísticas de
+ * compresión y las pistas de búsqueda de cada montaje; s_journal_lock, el estado de la
+ * transacción en curso; i_data_sem, los extents y el contenido de cada inodo;
+ * y cada bloque de la tabla de inodos se copia con su buffer bloqueado
+ * (lock_buffer). Los manejadores del diario se abren antes de coger
+ * i_data_sem. i_writeback_sem va antes que las páginas y que i_data_sem.
+ */
+#define ASSOOFS_DEFAULT_COMMIT_INTERVAL 5
+
+/*
+ * Estadísticas de cada montaje (/proc/self/mountstats): cuántas veces se ha
+ * hecho cada operación, los bytes leídos y escritos, los aciertos y fallos de
+ * la caché de buffers al leer metadatos y un histograma de latencias por
+ * operación en el que la casilla i cuenta las que han tardado entre 2^i y
+ * 2^(i+1) - 1 ns. Son contadores por CPU sin atómicos, así que pueden estar
+ * siempre activos; se suman al leerlos.
+ */
+enum assoofs_op {
+    ASSOOFS_OP_READ,
+    ASSOOFS_OP_WRITE,
+    ASSOOFS_OP_LOOKUP,
+    ASSOOFS_OP_CREATE,
+    ASSOOFS_OP_MKDIR,
+    ASSOOFS_OP_UNLINK,
+    ASSOOFS_OP_ITERATE,
+    ASSOOFS_OP_COUNT,
+};
+
+static const char *const assoofs_op_names[ASSOOFS_OP_COUNT] = {
+    "read", "write", "lookup", "create", "mkdir", "unlink", "iterate",
+};
+
+#define ASSOOFS_LATENCY_BUCKETS 32  /* la última recoge todo lo que pasa de 2^31 ns (unos 2 s) */
+
+struct assoofs_stats {
+    uint64_t ops[ASSOOFS_OP_COUNT];
+    uint64_t bytes[ASSOOFS_OP_COUNT];    /* solo lectura y escritura */
+    uint64_t latency[ASSOOFS_OP_COUNT][ASSOOFS_LATENCY_BUCKETS];
+    uint64_t bh_hits;
+    uint64_t bh_misses;
+};
+
+#define CREATE_TRACE_POINTS
+#include "assoofs_trace.h"
+
+struct assoofs_sb_info {
+    spinlock_t s_lock;
+    struct assoofs_super_block_info *s_as; /* copia en memoria del superbloque */
+    struct buffer_head *s_sbh;             /* bloque 0, fijo mientras dure el montaje */
+    bool s_sb_dirty;                       /* s_as tiene cambios que no han pasado a s_sbh */
+    struct buffer_head **s_inode_bitmap;   /* bloques del mapa de inodos */
+    struct buffer_head **s_block_bitmap;   /* bloques del mapa de bloques */
+    uint64_t s_inode_hint;                 /* por dónde seguir buscando inodos libres */
+    uint64_t s_block_hint;                 /* por dónde seguir buscando bloques libres */
+    uint64_t s_reserved_blocks;            /* bloques prometidos a páginas sucias todavía sin asignar */
+    uint64_t s_cluster_bytes;              /* bytes de ficheros comprimidos escritos por clusters */
+    uint64_t s_cluster_disk_bytes;         /* lo que han ocupado en disco */
+    uint64_t s_clusters_compressed;        /* clusters guardados comprimidos */
+    uint64_t s_clusters_plain;             /* clusters que no ganaban nada comprimidos */
+    bool s_compress;                       /* los ficheros nuevos se comprimen (-o compress) */
+    struct crypto_shash *s_chksum_driver;  /* crc32c de superbloque, inodos y directorios */
+    struct assoofs_stats __percpu *s_stats;
+    unsigned int s_commit_interval;        /* segundos, 0 = sin volcado periódico */
+    struct delayed_work s_commit_work;
+    struct super_block *s_sb;
+
+    spinlock_t s_unwritten_lock;           /* s_unwritten, también desde el fin de E/S */
+    struct buffer_head *s_unwritten;       /* escritos en extents sin escribir, por convertir (encadenados por b_private) */
+    struct work_struct s_unwritten_work;
+    struct workqueue_struct *s_unwritten_wq;
+
+    spinlock_t s_journal_lock;
+    struct mutex s_commit_mutex;           /* un solo commit a la vez */
+    wait_queue_head_t s_journal_wait;
+    bool s_journal_locked;                 /* commit en curso: no se abren manejadores */
+    bool s_journal_aborted;                /* error del diario: ya no se confirma nada más */
+    int s_journal_updates;                 /* manejadores abiertos en la transacción en curso */
+    uint32_t s_running_tid;
+    uint32_t s_committed_tid;
+    uint64_t s_journal_head;               /* siguiente bloque libre del diario */
+    unsigned int s_txn_credits;            /* bloques reservados por los manejadores */
+    unsigned int s_txn_count;
+    unsigned int s_txn_max;                /* bloques que caben en una transacción */
+    struct buffer_head **s_txn_buffers;    /* buffers modificados en la transacción en curso */
+    struct buffer_head **s_txn_copies;     /* sus copias en el diario mientras se escribe */
+    struct buffer_head **s_journal_bhs;    /* bloques del diario que se están escribiendo */
+    struct assoofs_ckpt *s_ckpt;           /* confirmados pendientes de llegar a su sitio */
+    unsigned int s_ckpt_count;
+    uint64_t *s_revokes;                   /* bloques liberados que ya no se deben reproducir */
+    unsigned int s_revoke_count;
+};
+
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb)
+{
+    return sb->s_fs_info;
+}
+
+/*
+ * Inodo en memoria: el inodo de la VFS y la copia de su assoofs_inode_info
+ * van juntos en una sola reserva de assoofs_inode_cache.
+ */
+struct assoofs_inode {
+    struct assoofs_inode_info info;
+    struct rw_semaphore i_data_sem; /* extents y entradas de directorio de info */
+    struct mutex i_cluster_mutex;   /* un solo volcado a la vez de un fichero comprimido */
+    unsigned int i_da_pages;        /* páginas diferidas con reserva (bajo s_lock) */
+    atomic_t i_unwritten_io;        /* buffers en bloques sin escribir que esperan su conversión */
+    struct rw_semaphore i_writeback_sem; /* ASSOOFS_INODE_UNWRITTEN no cambia mientras se vuelca */
+    struct inode vfs_inode;
+};
+
+static inline struct assoofs_inode *ASSOOFS_INODE(struct inode *inode)
+{
+    return container_of(inode, struct assoofs_inode, vfs_inode);
+}
+
+static inline struct assoofs_inode_info *ASSOOFS_I(struct inode *inode)
+{
+    return &container_of(inode, struct assoofs_inode, vfs_inode)->info;
+}
+
+static inline struct rw_semaphore *ASSOOFS_DATA_SEM(struct inode *inode)
+{
+    return &container_of(inode, struct assoofs_inode, vfs_inode)->i_data_sem;
+}
+
+static inline struct mutex *ASSOOFS_CLUSTER_MUTEX(struct inode *inode)
+{
+    return &container_of(inode, struct assoofs_inode, vfs_inode)->i_cluster_mutex;
+}
+
+// Fichero pequeño con los datos dentro del propio inodo (ASSOOFS_INODE_INLINE)
+static inline bool assoofs_has_inline_data(struct assoofs_inode_info *inode_info)
+{
+    return inode_info->flags & ASSOOFS_INODE_INLINE;
+}
+
+// Fichero que se guarda por clusters comprimidos (ASSOOFS_INODE_COMPRESSED)
+static inline bool assoofs_compressed(struct assoofs_inode_info *inode_info)
+{
+    return inode_info->flags & ASSOOFS_INODE_COMPRESSED;
+}
+
+// Un cluster comprimido se vuelca por páginas enteras: con bloques pequeños y páginas grandes no llega a una
+static inline bool assoofs_cluster_fits(struct super_block *sb)
+{
+    return ((size_t)ASSOOFS_CLUSTER_BLOCKS << sb->s_blocksize_bits) >= PAGE_SIZE;
+}
+
+// Bloques del sistema de ficheros que caben en una página de la caché (1 si son del mismo tamaño)
+static inline unsigned int assoofs_page_blocks(struct super_block *sb)
+{
+    return PAGE_SIZE >> sb->s_blocksize_bits;
+}
+
+static inline bool assoofs_sync_mode(struct super_block *sb)
+{
+    return sb->s_flags & SB_SYNCHRONOUS;
+}
+
+// Cuenta una operación terminada que empezó en start (ktime_get_ns) y la manda al tracepoint
+static void assoofs_op_done(struct super_block *sb, enum assoofs_op op, unsigned long ino, loff_t offset, size_t length, long result, u64 start)
+{
+    struct assoofs_stats __percpu *stats = ASSOOFS_SB(sb)->s_stats;
+    u64 duration = ktime_get_ns() - start;
+
+    this_cpu_inc(stats->ops[op]);
+    if (result > 0 && (op == ASSOOFS_OP_READ || op == ASSOOFS_OP_WRITE))
+    {
+        this_cpu_add(stats->bytes[op], result);
+    }
+    this_cpu_inc(stats->latency[op][min_t(unsigned int, ilog2(duration | 1), ASSOOFS_LATENCY_BUCKETS - 1)]);
+    trace_assoofs_op(sb, op, ino, offset, length, result, duration);
+}
+
+// sb_bread que cuenta si el bloque ya estaba al día en la caché de buffers
+static struct buffer_head *assoofs_bread(struct super_block *sb, sector_t block)
+{
+    struct buffer_head *bh;
+
+    bh = sb_getblk(sb, block);
+    if (!bh)
+    {
+        return NULL;
+    }
+    if (buffer_uptodate(bh))
+    {
+        this_cpu_inc(ASSOOFS_SB(sb)->s_stats->bh_hits);
+        return bh;
+    }
+    this_cpu_inc(ASSOOFS_SB(sb)->s_stats->bh_misses);
+    if (bh_read(bh, 0) < 0)
+    {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/*
+ *  Sumas de comprobación
+ *
+ * El crc32c se pide a la API de cifrado para que use la implementación del
+ * procesador (SSE4.2/PCLMUL en x86). Se comprueba al leer del disco: el
+ * superbloque al montar, cada inodo al cargarlo en la caché de inodos y cada
+ * bloque de directorio la primera vez que se usa después de leerlo
+ * (BH_Assoofs_Verified). Se recalcula justo antes de pasar el bloque al
+ * diario.
+ */
+static uint32_t assoofs_crc32c(struct crypto_shash *tfm, uint32_t crc, const void *address, unsigned int length)
+{
+    SHASH_DESC_ON_STACK(desc, tfm);
+    int err;
+
+    desc->tfm = tfm;
+    *(uint32_t *)shash_desc_ctx(desc) = crc;
+    err = crypto_shash_update(desc, address, length);
+    BUG_ON(err);
+    return *(uint32_t *)shash_desc_ctx(desc);
+}
+
+static uint32_t assoofs_sb_csum(struct crypto_shash *tfm, struct assoofs_super_block_info *as)
+{
+    return assoofs_crc32c(tfm, ASSOOFS_CRC32C_SEED, as, offsetof(struct assoofs_super_block_info, checksum));
+}
+
+// Suma del registro del inodo tal como queda en la tabla, con checksum a 0
+static uint32_t assoofs_inode_csum(struct super_block *sb, struct assoofs_inode_info *inode_info)
+{
+    uint32_t saved = inode_info->checksum;
+    uint32_t crc;
+
+    inode_info->checksum = 0;
+    crc = assoofs_crc32c(ASSOOFS_SB(sb)->s_chksum_driver, ASSOOFS_CRC32C_SEED, inode_info, sizeof(*inode_info));
+    inode_info->checksum = saved;
+    return crc;
+}
+
+static inline struct assoofs_dir_tail *assoofs_dir_tail(struct super_block *sb, void *block)
+{
+    return block + sb->s_blocksize - sizeof(struct assoofs_dir_tail);
+}
+
+// El número de inodo del directorio entra en la suma: un bloque de otro directorio no cuadra
+static uint32_t assoofs_dir_csum(struct super_block *sb, uint64_t dir_ino, void *block)
+{
+    struct crypto_shash *tfm = ASSOOFS_SB(sb)->s_chksum_driver;
+    uint32_t crc;
+
+    crc = assoofs_crc32c(tfm, ASSOOFS_CRC32C_SEED, &dir_ino, sizeof(dir_ino));
+    return assoofs_crc32c(tfm, crc, block, sb->s_blocksize - sizeof(uint32_t));
+}
+
+/*
+ *  Diario de metadatos
+ *
+ * Cada operación abre un manejador (assoofs_journal_start) antes de tocar
+ * metadatos y lo cierra al terminar (assoofs_journal_stop). Los buffers que
+ * modifica no se marcan sucios sino que se añaden a la transacción en curso,
+ * y todas las operaciones que coinciden en el tiempo comparten transacción.
+ * assoofs_journal_commit la escribe en el diario con un único flush. Los
+ * buffers del diario nunca se marcan sucios: cada bloque confirmado se queda
+ * en memoria junto con la copia que se escribió en el diario (s_ckpt), y es
+ * esa copia la que llega a su sitio cuando no queda sitio en el diario o al
+ * desmontar (assoofs_journal_checkpoint). Así el volcado normal de la caché
+ * no puede llevar a disco un bloque con una transacción a medias. Cuando se
+ * libera un bloque de metadatos que está en el diario se revoca
+ * (assoofs_journal_forget) para que no se reproduzca encima de lo que se
+ * escriba después en él.
+ *
+ * Los datos de los ficheros no pasan por el diario.
+ */
+#define ASSOOFS_JOURNAL_CREDITS 16  /* bloques de metadatos de una operación normal */
+#define ASSOOFS_HANDLE_MAGIC 0x41534a48  /* "ASJH": primer campo de todo manejador abierto */
+
+struct assoofs_handle {
+    uint32_t h_magic;
+    struct super_block *h_sb;
+    uint32_t h_tid;
+    int h_ref;      /* operaciones anidadas en la misma tarea */
+    unsigned int h_credits; /* bloques reservados en la transacción */
+    unsigned int h_used;    /* bloques que ha metido en ella */
+    bool h_delalloc; /* las reservas de bloques salen de s_reserved_blocks */
+    unsigned int h_nofs;  /* memalloc_nofs_save mientras está abierto */
+    void *h_prev;   /* journal_info de otro sistema de ficheros que había antes */
+};
+
+/*
+ * Manejador que la tarea tiene abierto en sb, o NULL. current->journal_info
+ * puede ser de otro sistema de ficheros (o un valor que no es un puntero,
+ * como los de btrfs): solo se mira su primer campo si apunta a memoria del
+ * núcleo y solo se usa si lleva ASSOOFS_HANDLE_MAGIC.
+ */
+static struct assoofs_handle *assoofs_current_handle(struct super_block *sb)
+{
+    struct assoofs_handle *handle = current->journal_info;
+
+    if ((unsigned long)handle < PAGE_SIZE || handle->h_magic != ASSOOFS_HANDLE_MAGIC || handle->h_sb != sb)
+    {
+        return NULL;
+    }
+    return handle;
+}
+
+/*
+ * Bloque confirmado que todavía no está en su sitio: su buffer (que puede
+ * tener ya cambios de la transacción en curso) y la copia que se escribió en
+ * el diario. El b_private del buffer guarda su posición en s_ckpt más uno.
+ */
+struct assoofs_ckpt {
+    struct buffer_head *live;
+    struct buffer_head *copy;
+};
+
+// Marcas de los buffers que ya están en la transacción en curso y de los bloques de directorio ya comprobados
+enum {
+    BH_Assoofs_Txn = BH_PrivateStart,
+    BH_Assoofs_Verified,
+};
+BUFFER_FNS(Assoofs_Txn, assoofs_txn)
+TAS_BUFFER_FNS(Assoofs_Txn, assoofs_txn)
+BUFFER_FNS(Assoofs_Verified, assoofs_verified)
+
+// Los tid crecen siempre y pueden dar la vuelta
+static inline bool assoofs_tid_geq(uint32_t x, uint32_t y)
+{
+    return (int32_t)(x - y) >= 0;
+}
+
+// Bloques de diario que ocupa una transacción de n bloques: descriptores, copias y commit
+static inline uint64_t assoofs_journal_space(struct super_block *sb, unsigned int n)
+{
+    return n + DIV_ROUND_UP(n, ASSOOFS_JOURNAL_TAGS(sb->s_blocksize)) + 1;
+}
+
+// Bloques del diario para una operación que libera bloques de datos (pueden estar en cualquier parte del mapa)
+static inline unsigned int assoofs_truncate_credits(struct super_block *sb)
+{
+    return ASSOOFS_JOURNAL_CREDITS + ASSOOFS_SB(sb)->s_as->block_bitmap_blocks;
+}
+
+// Bloque blk del diario, bloqueado y a cero para rellenarlo
+static struct buffer_head *assoofs_journal_getblk(struct super_block *sb, uint64_t blk)
+{
+    struct buffer_head *bh;
+
+    bh = sb_getblk(sb, ASSOOFS_SB(sb)->s_as->journal_block + blk);
+    if (!bh)
+    {
+        return NULL;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    return bh;
+}
+
+static void assoofs_journal_header(struct buffer_head *bh, uint32_t type, uint32_t tid, uint32_t count)
+{
+    struct assoofs_journal_header *header = (struct assoofs_journal_header *)bh->b_data;
+
+    header->h_magic = ASSOOFS_JOURNAL_MAGIC;
+    header->h_type = type;
+    header->h_tid = tid;
+    header->h_count = count;
+}
+
+// Escribe un bloque del diario que ya está relleno; con op_flags (flush/FUA) espera a que termine
+static int assoofs_journal_submit(struct buffer_head *bh, blk_opf_t op_flags)
+{
+    set_buffer_uptodate(bh);
+    mark_buffer_dirty(bh);
+    unlock_buffer(bh);
+    write_dirty_buffer(bh, op_flags);
+    if (!op_flags)
+    {
+        return 0;
+    }
+
+    wait_on_buffer(bh);
+    return buffer_uptodate(bh) ? 0 : -EIO;
+}
+
+/*
+ * Error del diario: lo que no esté confirmado ya no llega a disco, ni por el
+ * diario ni a su sitio, y el sistema de ficheros pasa a solo lectura. Lo
+ * confirmado sigue en el diario y se reproduce al montar.
+ */
+static void assoofs_journal_abort(struct super_block *sb, const char *why)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    spin_lock(&sbi->s_journal_lock);
+    if (sbi->s_journal_aborted)
+    {
+        spin_unlock(&sbi->s_journal_lock);
+        return;
+    }
+    sbi->s_journal_aborted = true;
+    spin_unlock(&sbi->s_journal_lock);
+
+    printk(KERN_CRIT "assoofs: journal aborted: %s; remounting read-only\n", why);
+    sb->s_flags |= SB_RDONLY;
+}
+
+/*
+ * Mete bh en la transacción en curso si no está ya. Devuelve false si no
+ * cabe, lo que no puede pasar si cada manejador respeta sus créditos (la
+ * transacción nunca pasa de s_txn_max con el superbloque).
+ */
+static bool assoofs_journal_add(struct assoofs_sb_info *sbi, struct buffer_head *bh)
+{
+    bool added = false;
+    unsigned int i;
+
+    if (test_set_buffer_assoofs_txn(bh))
+    {
+        return true;
+    }
+
+    spin_lock(&sbi->s_journal_lock);
+    // Vuelve a ser metadato en esta transacción: su copia nueva es la que vale
+    for (i = 0; i < sbi->s_revoke_count; i++)
+    {
+        if (sbi->s_revokes[i] == bh->b_blocknr)
+        {
+            sbi->s_revokes[i] = sbi->s_revokes[--sbi->s_revoke_count];
+            break;
+        }
+    }
+    if (sbi->s_txn_count < sbi->s_txn_max)
+    {
+        get_bh(bh);
+        sbi->s_txn_buffers[sbi->s_txn_count++] = bh;
+        added = true;
+    }
+    spin_unlock(&sbi->s_journal_lock);
+
+    if (WARN_ON_ONCE(!added))
+    {
+        clear_buffer_assoofs_txn(bh);
+    }
+    return added;
+}
+
+// bh pasa a estar pendiente de checkpoint con la copia copy (se queda con las dos referencias)
+static void assoofs_ckpt_add(struct assoofs_sb_info *sbi, struct buffer_head *bh, struct buffer_head *copy)
+{
+    unsigned long idx = (unsigned long)bh->b_private;
+    struct buffer_head *old;
+
+    if (idx)
+    {
+        // Ya estaba por una transacción anterior: la copia nueva sustituye a la vieja
+        old = sbi->s_ckpt[idx - 1].copy;
+        sbi->s_ckpt[idx - 1].copy = copy;
+        put_bh(bh);
+        brelse(old);
+        return;
+    }
+    sbi->s_ckpt[sbi->s_ckpt_count].live = bh;
+    sbi->s_ckpt[sbi->s_ckpt_count].copy = copy;
+    bh->b_private = (void *)(unsigned long)++sbi->s_ckpt_count;
+}
+
+// Quita bh de los pendientes de checkpoint; devuelve su copia (NULL si no estaba) para soltarla después
+static struct buffer_head *assoofs_ckpt_del(struct assoofs_sb_info *sbi, struct buffer_head *bh)
+{
+    unsigned long idx = (unsigned long)bh->b_private;
+    struct buffer_head *copy;
+
+    if (!idx)
+    {
+        return NULL;
+    }
+    copy = sbi->s_ckpt[idx - 1].copy;
+    sbi->s_ckpt[idx - 1] = sbi->s_ckpt[--sbi->s_ckpt_count];
+    sbi->s_ckpt[idx - 1].live->b_private = (void *)idx;
+    bh->b_private = NULL;
+    put_bh(bh);
+    return copy;
+}
+
+static int assoofs_journal_checkpoint(struct super_block *sb, uint32_t next_tid);
+
+/*
+ * Escribe la transacción tid en el diario a partir de s_journal_head:
+ * descriptores y copias primero y, cuando han terminado, el commit con un
+ * flush previo y FUA; las revocaciones van en sus propios bloques antes del
+ * commit. Si no cabe detrás de lo que ya hay se hace antes un checkpoint (que
+ * hace innecesarias las revocaciones) y se escribe desde el principio. Después cada buffer queda
+ * pendiente de checkpoint con su copia. Se llama sin manejadores abiertos.
+ */
+static int assoofs_journal_write(struct super_block *sb, uint32_t tid)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_journal_descriptor *desc;
+    struct assoofs_journal_commit *commit;
+    struct buffer_head *bh;
+    uint64_t blk = sbi->s_journal_head;
+    unsigned int n = sbi->s_txn_count;
+    unsigned int nr = 0;
+    unsigned int count;
+    unsigned int i, j;
+    uint32_t crc = ~0U;
+    int ret = sbi->s_journal_aborted ? -EIO : 0;
+
+    if (!n && !sbi->s_revoke_count)
+    {
+        return ret;
+    }
+
+    // Lo ampliado con assoofs_journal_extend puede no caber detrás de la cabeza, pero s_txn_max cabe siempre en el diario vacío
+    if (!ret && blk + assoofs_journal_space(sb, n) + DIV_ROUND_UP(sbi->s_revoke_count, ASSOOFS_JOURNAL_TAGS(sb->s_blocksize)) > sbi->s_as->journal_blocks)
+    {
+        ret = assoofs_journal_checkpoint(sb, tid);
+        blk = sbi->s_journal_head;
+    }
+
+    memset(sbi->s_txn_copies, 0, n * sizeof(*sbi->s_txn_copies));
+    for (i = 0; i < n && !ret; i += count)
+    {
+        count = min_t(unsigned int, n - i, ASSOOFS_JOURNAL_TAGS(sb->s_blocksize));
+
+        bh = assoofs_journal_getblk(sb, blk++);
+        if (!bh)
+        {
+            ret = -EIO;
+            break;
+        }
+        assoofs_journal_header(bh, ASSOOFS_JOURNAL_DESCRIPTOR, tid, count);
+        desc = (struct assoofs_journal_descriptor *)bh->b_data;
+        for (j = 0; j < count; j++)
+        {
+            desc->d_blocks[j] = sbi->s_txn_buffers[i + j]->b_blocknr;
+        }
+        assoofs_journal_submit(bh, 0);
+        sbi->s_journal_bhs[nr++] = bh;
+
+        for (j = 0; j < count; j++)
+        {
+            bh = assoofs_journal_getblk(sb, blk++);
+            if (!bh)
+            {
+                ret = -EIO;
+                break;
+            }
+            memcpy(bh->b_data, sbi->s_txn_buffers[i + j]->b_data, sb->s_blocksize);
+            crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+            assoofs_journal_submit(bh, 0);
+            sbi->s_journal_bhs[nr++] = bh;
+            sbi->s_txn_copies[i + j] = bh;
+            get_bh(bh);
+        }
+    }
+
+    for (i = 0; i < sbi->s_revoke_count && !ret; i += count)
+    {
+        count = min_t(unsigned int, sbi->s_revoke_count - i, ASSOOFS_JOURNAL_TAGS(sb->s_blocksize));
+
+        bh = assoofs_journal_getblk(sb, blk++);
+        if (!bh)
+        {
+            ret = -EIO;
+            break;
+        }
+        assoofs_journal_header(bh, ASSOOFS_JOURNAL_REVOKE, tid, count);
+        desc = (struct assoofs_journal_descriptor *)bh->b_data;
+        memcpy(desc->d_blocks, sbi->s_revokes + i, count * sizeof(*desc->d_blocks));
+        crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+        assoofs_journal_submit(bh, 0);
+        sbi->s_journal_bhs[nr++] = bh;
+    }
+
+    for (i = 0; i < nr; i++)
+    {
+        wait_on_buffer(sbi->s_journal_bhs[i]);
+        if (!buffer_uptodate(sbi->s_journal_bhs[i]))
+        {
+            ret = -EIO;
+        }
+        brelse(sbi->s_journal_bhs[i]);
+    }
+
+    if (!ret)
+    {
+        bh = assoofs_journal_getblk(sb, blk++);
+        if (bh)
+        {
+            assoofs_journal_header(bh, ASSOOFS_JOURNAL_COMMIT, tid, n);
+            commit = (struct assoofs_journal_commit *)bh->b_data;
+            commit->c_crc = crc;
+            ret = assoofs_journal_submit(bh, REQ_PREFLUSH | REQ_FUA);
+            brelse(bh);
+        }
+        else
+        {
+            ret = -EIO;
+        }
+    }
+    if (ret)
+    {
+        printk(KERN_ERR "assoofs: unable to write transaction %u to the journal\n", tid);
+    }
+    else
+    {
+        sbi->s_revoke_count = 0;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        bh = sbi->s_txn_buffers[i];
+        clear_buffer_assoofs_txn(bh);
+        if (!ret)
+        {
+            assoofs_ckpt_add(sbi, bh, sbi->s_txn_copies[i]);
+            continue;
+        }
+        // Sin confirmar no llega a disco: si ya estaba confirmado antes se sigue escribiendo esa copia
+        brelse(sbi->s_txn_copies[i]);
+        brelse(bh);
+    }
+    sbi->s_txn_count = 0;
+    if (ret)
+    {
+        assoofs_journal_abort(sb, "unable to write a transaction");
+    }
+    sbi->s_journal_head = blk;
+    return ret;
+}
+
+/*
+ * Escribe a su sitio todo lo confirmado y deja el diario vacío, esperando la
+ * transacción next_tid. Cada bloque se escribe desde su copia del diario y no
+ * desde el buffer, que puede llevar ya cambios sin confirmar. Se llama sin
+ * manejadores abiertos.
+ */
+static int assoofs_journal_checkpoint(struct super_block *sb, uint32_t next_tid)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_ckpt *ckpt;
+    struct buffer_head *bh;
+    struct bio *bio = NULL;
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < sbi->s_ckpt_count; i++)
+    {
+        ckpt = &sbi->s_ckpt[i];
+        bio = blk_next_bio(bio, sb->s_bdev, 1, REQ_OP_WRITE, GFP_NOFS);
+        bio->bi_iter.bi_sector = ckpt->live->b_blocknr << (sb->s_blocksize_bits - SECTOR_SHIFT);
+        bio_add_page(bio, ckpt->copy->b_page, sb->s_blocksize, bh_offset(ckpt->copy));
+    }
+    if (bio)
+    {
+        ret = submit_bio_wait(bio);
+        bio_put(bio);
+    }
+    if (ret)
+    {
+        return ret;
+    }
+    for (i = 0; i < sbi->s_ckpt_count; i++)
+    {
+        ckpt = &sbi->s_ckpt[i];
+        ckpt->live->b_private = NULL;
+        brelse(ckpt->live);
+        brelse(ckpt->copy);
+    }
+    sbi->s_ckpt_count = 0;
+    // Con el diario vacío no queda nada que revocar
+    sbi->s_revoke_count = 0;
+
+    // Lo reproducido al montar y lo que no pudo pasar por el diario sí está sucio en la caché
+    ret = sync_blockdev(sb->s_bdev);
+    if (ret)
+    {
+        return ret;
+    }
+
+    // El flush previo deja en disco lo anterior antes de que el diario deje de apuntarlo
+    bh = assoofs_journal_getblk(sb, 0);
+    if (!bh)
+    {
+        return -EIO;
+    }
+    assoofs_journal_header(bh, ASSOOFS_JOURNAL_SUPER, next_tid, 0);
+    ret = assoofs_journal_submit(bh, REQ_PREFLUSH | REQ_FUA);
+    brelse(bh);
+    if (ret)
+    {
+        return ret;
+    }
+
+    ASSOOFS_SB(sb)->s_journal_head = 1;
+    return 0;
+}
+
+/*
+ * Si los contadores han cambiado desde el último commit, los copia al bloque 0
+ * y lo mete en la transacción. Se llama al confirmarla, sin manejadores
+ * abiertos, así que el superbloque que llega al diario va con los mapas de
+ * bits de esa misma transacción.
+ */
+static void assoofs_save_sb_info(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *as = (struct assoofs_super_block_info *)sbi->s_sbh->b_data;
+    bool dirty;
+
+    lock_buffer(sbi->s_sbh);
+    spin_lock(&sbi->s_lock);
+    dirty = sbi->s_sb_dirty;
+    if (dirty)
+    {
+        memcpy(as, sbi->s_as, sizeof(*as));
+        sbi->s_sb_dirty = false;
+    }
+    spin_unlock(&sbi->s_lock);
+    if (dirty)
+    {
+        as->checksum = assoofs_sb_csum(sbi->s_chksum_driver, as);
+    }
+    unlock_buffer(sbi->s_sbh);
+
+    if (dirty)
+    {
+        assoofs_journal_add(sbi, sbi->s_sbh);
+    }
+}
+
+/*
+ * Confirma la transacción tid si no lo está ya: no deja abrir manejadores
+ * nuevos, espera a que se cierren los que están dentro y la escribe. Si otro
+ * hilo ya la ha confirmado (junto con las suyas) no hace nada. Con checkpoint,
+ * o si ya no cabe otra operación en el diario, lo vacía a continuación.
+ */
+static int assoofs_journal_commit(struct super_block *sb, uint32_t tid, bool checkpoint)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    int ret;
+
+    mutex_lock(&sbi->s_commit_mutex);
+    spin_lock(&sbi->s_journal_lock);
+    if (assoofs_tid_geq(sbi->s_committed_tid, tid))
+    {
+        spin_unlock(&sbi->s_journal_lock);
+        mutex_unlock(&sbi->s_commit_mutex);
+        return 0;
+    }
+    sbi->s_journal_locked = true;
+    spin_unlock(&sbi->s_journal_lock);
+
+    wait_event(sbi->s_journal_wait, !READ_ONCE(sbi->s_journal_updates));
+
+    assoofs_save_sb_info(sb);
+    ret = assoofs_journal_write(sb, tid);
+    if (!ret && (checkpoint || sbi->s_journal_head + assoofs_journal_space(sb, ASSOOFS_JOURNAL_CREDITS) > sbi->s_as->journal_blocks))
+    {
+        ret = assoofs_journal_checkpoint(sb, tid + 1);
+    }
+
+    spin_lock(&sbi->s_journal_lock);
+    sbi->s_committed_tid = tid;
+    sbi->s_running_tid = tid + 1;
+    sbi->s_txn_credits = 0;
+    sbi->s_journal_locked = false;
+    spin_unlock(&sbi->s_journal_lock);
+    wake_up_all(&sbi->s_journal_wait);
+
+    mutex_unlock(&sbi->s_commit_mutex);
+    return ret;
+}
+
+// Confirma la transacción en curso con todo lo que se haya agrupado en ella
+static int assoofs_journal_force(struct super_block *sb, bool checkpoint)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint32_t tid;
+
+    spin_lock(&sbi->s_journal_lock);
+    tid = sbi->s_running_tid;
+    spin_unlock(&sbi->s_journal_lock);
+
+    return assoofs_journal_commit(sb, tid, checkpoint);
+}
+
+/*
+ * Amplía en credits bloques lo reservado por el manejador si la transacción
+ * sigue cabiendo en el diario vacío (journal_write hace antes un checkpoint
+ * si hace falta); uno se deja para el superbloque.
+ */
+static int assoofs_journal_extend(struct assoofs_handle *handle, unsigned int credits)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(handle->h_sb);
+    int ret = -ENOSPC;
+
+    spin_lock(&sbi->s_journal_lock);
+    if (sbi->s_txn_credits + credits + 1 <= sbi->s_txn_max)
+    {
+        sbi->s_txn_credits += credits;
+        handle->h_credits += credits;
+        ret = 0;
+    }
+    spin_unlock(&sbi->s_journal_lock);
+    return ret;
+}
+
+/*
+ * Abre un manejador en la transacción en curso reservando credits bloques del
+ * diario. Si la transacción ya no cabe en lo que queda de diario se confirma
+ * y se vacía el diario antes de entrar. Mientras está abierto ninguna reserva
+ * de memoria de la tarea puede entrar en el sistema de ficheros para liberar
+ * memoria (new_inode, por ejemplo, usa GFP_KERNEL), que podría necesitar
+ * confirmar la transacción que la propia tarea tiene abierta.
+ */
+static struct assoofs_handle *assoofs_journal_start(struct super_block *sb, unsigned int credits)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_handle *handle = assoofs_current_handle(sb);
+    uint32_t tid;
+
+    // Operación anidada (por ejemplo evict_inode desde create): entra en el manejador de fuera
+    if (handle)
+    {
+        handle->h_ref++;
+        // Lo que necesite la operación de dentro se suma a lo reservado; si no cabe lo dirá assoofs_journal_dirty
+        assoofs_journal_extend(handle, credits);
+        return handle;
+    }
+    // Lo que haya en journal_info (de otro sistema de ficheros o de otro assoofs) no se toca: se apila encima
+    handle = kmalloc(sizeof(*handle), GFP_NOFS | __GFP_NOFAIL);
+    handle->h_magic = ASSOOFS_HANDLE_MAGIC;
+    handle->h_sb = sb;
+    handle->h_ref = 1;
+    handle->h_used = 0;
+    handle->h_delalloc = false;
+    handle->h_prev = current->journal_info;
+    credits = min(credits, sbi->s_txn_max - 1);
+
+    spin_lock(&sbi->s_journal_lock);
+    for (;;)
+    {
+        if (sbi->s_journal_locked)
+        {
+            spin_unlock(&sbi->s_journal_lock);
+            wait_event(sbi->s_journal_wait, !READ_ONCE(sbi->s_journal_locked));
+            spin_lock(&sbi->s_journal_lock);
+            continue;
+        }
+        // Uno más para el superbloque, que entra al confirmar
+        if (sbi->s_journal_head + assoofs_journal_space(sb, sbi->s_txn_credits + credits + 1) <= sbi->s_as->journal_blocks)
+        {
+            break;
+        }
+
+        tid = sbi->s_running_tid;
+        spin_unlock(&sbi->s_journal_lock);
+        assoofs_journal_commit(sb, tid, true);
+        spin_lock(&sbi->s_journal_lock);
+    }
+    sbi->s_journal_updates++;
+    sbi->s_txn_credits += credits;
+    handle->h_credits = credits;
+    handle->h_tid = sbi->s_running_tid;
+    spin_unlock(&sbi->s_journal_lock);
+
+    handle->h_nofs = memalloc_nofs_save();
+    current->journal_info = handle;
+    return handle;
+}
+
+// Cierra el manejador; en modo síncrono espera a que su transacción esté confirmada
+static int assoofs_journal_stop(struct assoofs_handle *handle)
+{
+    struct super_block *sb = handle->h_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint32_t tid = handle->h_tid;
+    bool wake;
+
+    if (--handle->h_ref)
+    {
+        return 0;
+    }
+    current->journal_info = handle->h_prev;
+    memalloc_nofs_restore(handle->h_nofs);
+    handle->h_magic = 0;
+    kfree(handle);
+
+    spin_lock(&sbi->s_journal_lock);
+    wake = !--sbi->s_journal_updates && sbi->s_journal_locked;
+    spin_unlock(&sbi->s_journal_lock);
+    if (wake)
+    {
+        wake_up_all(&sbi->s_journal_wait);
+    }
+
+    if (assoofs_sync_mode(sb))
+    {
+        return assoofs_journal_commit(sb, tid, false);
+    }
+    return 0;
+}
+
+/*
+ * Añade un buffer de metadatos ya modificado a la transacción en curso con
+ * cargo a los créditos del manejador. Si la operación se pasa de lo que
+ * reservó se amplía la reserva; si la transacción ya no cabe en el diario se
+ * aborta el diario: nunca se escribe a su sitio sin pasar por él.
+ */
+static void assoofs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+    struct assoofs_handle *handle = assoofs_current_handle(sb);
+
+    if (WARN_ON_ONCE(!handle))
+    {
+        // Sin manejador: se abre uno solo para este bloque
+        handle = assoofs_journal_start(sb, 1);
+        assoofs_journal_dirty(sb, bh);
+        assoofs_journal_stop(handle);
+        return;
+    }
+    if (buffer_assoofs_txn(bh))
+    {
+        return;
+    }
+    if (handle->h_used >= handle->h_credits)
+    {
+        printk_once(KERN_WARNING "assoofs: operation used more journal credits than it reserved\n");
+        if (assoofs_journal_extend(handle, 1))
+        {
+            assoofs_journal_abort(sb, "transaction does not fit in the journal");
+            return;
+        }
+    }
+    if (!assoofs_journal_add(ASSOOFS_SB(sb), bh))
+    {
+        assoofs_journal_abort(sb, "transaction is full");
+        return;
+    }
+    handle->h_used++;
+}
+
+/*
+ * El bloque blk de metadatos se libera: sale de la transacción en curso, si
+ * estaba confirmado deja de esperar al checkpoint y se revoca para que no se
+ * reproduzca, y su buffer se descarta sin escribirlo.
+ */
+static void assoofs_journal_forget(struct super_block *sb, uint64_t blk)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *bh, *copy;
+    bool txn = false;
+    unsigned int i;
+
+    bh = sb_find_get_block(sb, blk);
+    if (!bh)
+    {
+        return;
+    }
+
+    spin_lock(&sbi->s_journal_lock);
+    if (buffer_assoofs_txn(bh))
+    {
+        for (i = 0; i < sbi->s_txn_count; i++)
+        {
+            if (sbi->s_txn_buffers[i] == bh)
+            {
+                sbi->s_txn_buffers[i] = sbi->s_txn_buffers[--sbi->s_txn_count];
+                clear_buffer_assoofs_txn(bh);
+                txn = true;
+                break;
+            }
+        }
+    }
+    copy = assoofs_ckpt_del(sbi, bh);
+    if (copy)
+    {
+        sbi->s_revokes[sbi->s_revoke_count++] = blk;
+    }
+    spin_unlock(&sbi->s_journal_lock);
+
+    if (txn)
+    {
+        put_bh(bh);
+    }
+    brelse(copy);
+    bforget(bh);
+}
+
+/*
+ * Recorre la transacción que empieza en el bloque blk del diario: todos sus
+ * bloques tienen el mismo tid (el primero, posterior o igual a *tid), las
+ * copias cubren lo que indican los descriptores y el commit tiene su número y
+ * su crc. Sin replay y con revoked apunta en revoked las revocaciones de la
+ * transacción; con replay copia cada bloque a su sitio salvo los revocados
+ * por esa transacción o una posterior. Devuelve 1 si la
+ * transacción es válida (con su tid en *tid y el bloque siguiente en *next),
+ * 0 si está incompleta o es de una vuelta anterior del diario y un error si
+ * falla la lectura.
+ */
+static int assoofs_journal_scan(struct super_block *sb, uint64_t blk, uint32_t *tid, uint64_t *next, struct xarray *revoked, bool replay)
+{
+    struct assoofs_super_block_info *as = ASSOOFS_SB(sb)->s_as;
+    struct assoofs_journal_header *header;
+    struct assoofs_journal_descriptor *desc;
+    struct assoofs_journal_commit *commit;
+    struct buffer_head *bh, *copy, *home;
+    uint32_t crc = ~0U;
+    uint32_t total = 0;
+    uint32_t blocks = 0;
+    uint64_t target;
+    void *entry;
+    uint32_t i;
+    int ret;
+
+    for (;;)
+    {
+        if (blk >= as->journal_blocks)
+        {
+            return 0;
+        }
+        bh = sb_bread(sb, as->journal_block + blk++);
+        if (!bh)
+        {
+            return -EIO;
+        }
+
+        header = (struct assoofs_journal_header *)bh->b_data;
+        if (header->h_magic != ASSOOFS_JOURNAL_MAGIC || (blocks ? header->h_tid != *tid : !assoofs_tid_geq(header->h_tid, *tid)))
+        {
+            brelse(bh);
+            return 0;
+        }
+        *tid = header->h_tid;
+
+        if (header->h_type == ASSOOFS_JOURNAL_COMMIT)
+        {
+            commit = (struct assoofs_journal_commit *)bh->b_data;
+            ret = blocks && header->h_count == total && commit->c_crc == crc;
+            brelse(bh);
+            *next = blk;
+            return ret;
+        }
+        if (header->h_type == ASSOOFS_JOURNAL_REVOKE && header->h_count && header->h_count <= ASSOOFS_JOURNAL_TAGS(sb->s_blocksize))
+        {
+            crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+            desc = (struct assoofs_journal_descriptor *)bh->b_data;
+            for (i = 0; i < header->h_count && revoked && !replay; i++)
+            {
+                // Los revocados quedan con la última transacción que los revoca
+                ret = xa_err(xa_store(revoked, desc->d_blocks[i], xa_mk_value(*tid), GFP_KERNEL));
+                if (ret)
+                {
+                    brelse(bh);
+                    return ret;
+                }
+            }
+            blocks++;
+            brelse(bh);
+            continue;
+        }
+        if (header->h_type != ASSOOFS_JOURNAL_DESCRIPTOR || !header->h_count || header->h_count > ASSOOFS_JOURNAL_TAGS(sb->s_blocksize) ||
+            blk + header->h_count >= as->journal_blocks)
+        {
+            brelse(bh);
+            return 0;
+        }
+        blocks++;
+
+        desc = (struct assoofs_journal_descriptor *)bh->b_data;
+        for (i = 0; i < header->h_count; i++)
+        {
+            target = desc->d_blocks[i];
+            if (target >= as->blocks_count || (target >= as->journal_block && target < as->journal_block + as->journal_blocks))
+            {
+                brelse(bh);
+                return 0;
+            }
+
+            copy = sb_bread(sb, as->journal_block + blk++);
+            if (!copy)
+            {
+                brelse(bh);
+                return -EIO;
+            }
+            crc = crc32_le(crc, copy->b_data, sb->s_blocksize);
+            entry = replay ? xa_load(revoked, target) : NULL;
+            if (replay && !(entry && assoofs_tid_geq(xa_to_value(entry), *tid)))
+            {
+                home = sb_getblk(sb, target);
+                if (!home)
+                {
+                    brelse(copy);
+                    brelse(bh);
+                    return -EIO;
+                }
+                lock_buffer(home);
+                memcpy(home->b_data, copy->b_data, sb->s_blocksize);
+                set_buffer_uptodate(home);
+                unlock_buffer(home);
+                mark_buffer_dirty(home);
+                brelse(home);
+            }
+            brelse(copy);
+        }
+        total += header->h_count;
+        brelse(bh);
+    }
+}
+
+/*
+ * Al montar: reproduce en orden las transacciones confirmadas que quedaron en
+ * el diario, las escribe a su sitio y deja el diario vacío. Una revocación
+ * puede venir en una transacción posterior a la copia que anula, así que
+ * primero se recorren todas para recoger las revocaciones.
+ */
+static int assoofs_journal_load(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_journal_header *header;
+    struct buffer_head *bh;
+    struct xarray revoked;
+    unsigned int replayed = 0;
+    unsigned int count = 0;
+    uint64_t blk = 1;
+    uint64_t next;
+    uint32_t tid, first_tid, txn_tid;
+    int ret;
+
+    bh = sb_bread(sb, sbi->s_as->journal_block);
+    if (!bh)
+    {
+        return -EIO;
+    }
+    header = (struct assoofs_journal_header *)bh->b_data;
+    if (header->h_magic != ASSOOFS_JOURNAL_MAGIC || header->h_type != ASSOOFS_JOURNAL_SUPER)
+    {
+        printk(KERN_ERR "assoofs: invalid journal superblock\n");
+        brelse(bh);
+        return -EINVAL;
+    }
+    tid = header->h_tid;
+    brelse(bh);
+
+    // Primero se comprueba cada transacción entera y solo si está completa se recogen sus revocaciones
+    xa_init(&revoked);
+    first_tid = tid;
+    for (;;)
+    {
+        txn_tid = tid;
+        ret = assoofs_journal_scan(sb, blk, &txn_tid, &next, NULL, false);
+        if (ret <= 0)
+        {
+            break;
+        }
+        ret = assoofs_journal_scan(sb, blk, &txn_tid, &next, &revoked, false);
+        if (ret <= 0)
+        {
+            break;
+        }
+        count++;
+        tid = txn_tid + 1;
+        blk = next;
+    }
+
+    tid = first_tid;
+    blk = 1;
+    while (ret >= 0 && replayed < count)
+    {
+        txn_tid = tid;
+        ret = assoofs_journal_scan(sb, blk, &txn_tid, &next, &revoked, true);
+        if (ret <= 0)
+        {
+            break;
+        }
+        replayed++;
+        tid = txn_tid + 1;
+        blk = next;
+    }
+    xa_destroy(&revoked);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = assoofs_journal_checkpoint(sb, tid);
+    if (ret)
+    {
+        return ret;
+    }
+    sbi->s_running_tid = tid;
+    sbi->s_committed_tid = tid - 1;
+
+    // El superbloque también puede venir del diario
+    if (replayed)
+    {
+        printk(KERN_INFO "assoofs: replayed %u journal transactions\n", replayed);
+        // La reproducción escribe en el mismo buffer que s_sbh
+        memcpy(sbi->s_as, sbi->s_sbh->b_data, sizeof(*sbi->s_as));
+        if (sbi->s_as->checksum != assoofs_sb_csum(sbi->s_chksum_driver, sbi->s_as))
+        {
+            printk(KERN_ERR "assoofs: superblock checksum mismatch after journal replay\n");
+            return -EBADMSG;
+        }
+    }
+    return 0;
+}
+
+int assoofs_sb_set_a_freeblock(struct super_block *sb, uint64_t block);
+int assoofs_sb_set_freeblocks(struct super_block *sb, uint64_t block, uint32_t count);
+int assoofs_sb_get_a_freeinode(struct super_block *sb, unsigned long *inode);
+static int assoofs_remove(struct inode *dir, struct dentry *dentry);
+int assoofs_sb_set_a_freeinode(struct super_block *sb, unsigned long inode_no);
+static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
+static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_read_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info);
+static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
+void assoofs_evict_inode(struct inode *inode);
+static struct inode *assoofs_alloc_inode(struct super_block *sb);
+static void assoofs_free_inode(struct inode *inode);
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+int assoofs_sb_get_freeblocks(struct super_block *sb, uint64_t goal, uint32_t wanted, uint64_t *block, uint32_t *count);
+
+void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
+static struct buffer_head *assoofs_dir_find(struct inode *dir, const struct qstr *name, struct assoofs_dir_record_entry **res);
+static void assoofs_dir_delete_entry(struct super_block *sb, void *block, struct assoofs_dir_record_entry *de);
+static void assoofs_dir_dirty(struct super_block *sb, struct assoofs_inode_info *dir_info, struct buffer_head *bh);
+static void assoofs_free_extents(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static int assoofs_orphan_cleanup(struct super_block *sb);
+
+/*
+ * El inodo se ha quedado sin nombres pero puede seguir abierto: se marca
+ * huérfano en la misma transacción para que, si el sistema se cae antes de
+ * que assoofs_evict_inode lo libere, se libere al montar.
+ */
+static void assoofs_orphan_add(struct super_block *sb, struct inode *inode)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+
+    down_write(ASSOOFS_DATA_SEM(inode));
+    inode_info->flags |= ASSOOFS_INODE_ORPHAN;
+    assoofs_save_inode_info(sb, inode_info);
+    up_write(ASSOOFS_DATA_SEM(inode));
+
+    spin_lock(&sbi->s_lock);
+    sbi->s_as->orphan_count++;
+    sbi->s_sb_dirty = true;
+    spin_unlock(&sbi->s_lock);
+}
+
+static int assoofs_do_unlink(struct inode *dir, struct dentry *dentry){
+    struct super_block *sb;
+    struct inode *inode_remove;
+    struct assoofs_inode_info *parent_inode_info;
+    struct buffer_head *bh;
+    struct assoofs_dir_record_entry *dir_contents;
+    struct assoofs_handle *handle;
+    sb = dir->i_sb;
+    inode_remove = dentry->d_inode;
+    parent_inode_info = ASSOOFS_I(dir);
+    handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+    down_write(ASSOOFS_DATA_SEM(dir));
+    bh = assoofs_dir_find(dir, &dentry->d_name, &dir_contents);
+    if (IS_ERR_OR_NULL(bh) || dir_contents->inode_no != inode_remove->i_ino)
+    {
+        up_write(ASSOOFS_DATA_SEM(dir));
+        assoofs_journal_stop(handle);
+        if (IS_ERR(bh))
+        {
+            return PTR_ERR(bh);
+        }
+        brelse(bh);
+        return -ENOENT;
+    }
+
+    assoofs_dir_delete_entry(sb, bh->b_data, dir_contents);
+    assoofs_dir_dirty(sb, parent_inode_info, bh);
+    brelse(bh);
+
+    parent_inode_info->dir_children_count--;
+    assoofs_save_inode_info(sb, parent_inode_info);
+    up_write(ASSOOFS_DATA_SEM(dir));
+
+    // Los bloques y el número de inodo se liberan en assoofs_evict_inode, cuando nadie lo tenga abierto
+    inode_remove->i_ctime = dir->i_ctime = dir->i_mtime = current_time(dir);
+    drop_nlink(inode_remove);
+    if (!inode_remove->i_nlink)
+    {
+        assoofs_orphan_add(sb, inode_remove);
+    }
+    return assoofs_journal_stop(handle);
+
+}
+
+static int assoofs_remove(struct inode *dir, struct dentry *dentry)
+{
+    u64 start = ktime_get_ns();
+    int ret;
+
+    ret = assoofs_do_unlink(dir, dentry);
+    assoofs_op_done(dir->i_sb, ASSOOFS_OP_UNLINK, dir->i_ino, 0, dentry->d_name.len, ret, start);
+    return ret;
+}
+
+/*
+ *  Mapas de bits de inodos y bloques
+ */
+
+// Busca un bit a cero empezando en start y dando la vuelta al llegar al final
+static uint64_t assoofs_bitmap_find_zero(struct super_block *sb, struct buffer_head **bitmap, uint64_t nbits, uint64_t start)
+{
+    uint64_t bits_per_block = sb->s_blocksize * 8;
+    uint64_t bit = start < nbits ? start : 0;
+    uint64_t scanned = 0;
+    uint64_t blk, off, end, found;
+
+    while (scanned < nbits)
+    {
+        blk = bit / bits_per_block;
+        off = bit % bits_per_block;
+        end = min(bits_per_block, nbits - blk * bits_per_block);
+
+        found = find_next_zero_bit_le(bitmap[blk]->b_data, end, off);
+        if (found < end)
+        {
+            return blk * bits_per_block + found;
+        }
+
+        scanned += end - off;
+        bit = (blk + 1) * bits_per_block;
+        if (bit >= nbits)
+        {
+            bit = 0;
+        }
+    }
+    return nbits;
+}
+
+static inline int assoofs_bitmap_test(struct super_block *sb, struct buffer_head **bitmap, uint64_t bit)
+{
+    uint64_t bits_per_block = sb->s_blocksize * 8;
+
+    return test_bit_le(bit % bits_per_block, bitmap[bit / bits_per_block]->b_data);
+}
+
+// Marca count bits a partir de first como ocupados (used) o libres. Se llama con s_lock
+static void assoofs_bitmap_set(struct super_block *sb, struct buffer_head **bitmap, uint64_t first, uint64_t count, bool used)
+{
+    uint64_t bits_per_block = sb->s_blocksize * 8;
+    uint64_t bit;
+
+    for (bit = first; bit < first + count; bit++)
+    {
+        if (used)
+        {
+            __set_bit_le(bit % bits_per_block, bitmap[bit / bits_per_block]->b_data);
+        }
+        else
+        {
+            __clear_bit_le(bit % bits_per_block, bitmap[bit / bits_per_block]->b_data);
+        }
+    }
+}
+
+// Añade a la transacción los bloques del mapa que cubren esos bits (fuera de s_lock)
+static void assoofs_bitmap_dirty(struct super_block *sb, struct buffer_head **bitmap, uint64_t first, uint64_t count)
+{
+    uint64_t bits_per_block = sb->s_blocksize * 8;
+    uint64_t blk;
+
+    for (blk = first / bits_per_block; blk <= (first + count - 1) / bits_per_block; blk++)
+    {
+        assoofs_journal_dirty(sb, bitmap[blk]);
+    }
+}
+
+int assoofs_sb_get_a_freeinode(struct super_block *sb, unsigned long *inode){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_as;
+    uint64_t i;
+
+    spin_lock(&sbi->s_lock);
+    i = assoofs_bitmap_find_zero(sb, sbi->s_inode_bitmap, assoofs_sb->max_inodes, sbi->s_inode_hint);
+    if (i >= assoofs_sb->max_inodes){
+        spin_unlock(&sbi->s_lock);
+        return -ENOSPC;
+    }
+    assoofs_bitmap_set(sb, sbi->s_inode_bitmap, i, 1, true);
+    assoofs_sb->free_inodes--;
+    assoofs_sb->inodes_count++;
+    sbi->s_sb_dirty = true;
+    sbi->s_inode_hint = i + 1;
+    spin_unlock(&sbi->s_lock);
+
+    assoofs_bitmap_dirty(sb, sbi->s_inode_bitmap, i, 1);
+    *inode = i;
+    return 0;
+}
+
+int assoofs_sb_set_a_freeinode(struct super_block *sb, unsigned long inode_no){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_as;
+
+    if (inode_no <= ASSOOFS_ROOTDIR_INODE_NUMBER || inode_no >= assoofs_sb->max_inodes){
+        printk(KERN_ERR "assoofs: trying to free invalid inode %lu\n", inode_no);
+        return -EINVAL;
+    }
+
+    spin_lock(&sbi->s_lock);
+    assoofs_bitmap_set(sb, sbi->s_inode_bitmap, inode_no, 1, false);
+    assoofs_sb->free_inodes++;
+    assoofs_sb->inodes_count--;
+    sbi->s_sb_dirty = true;
+    spin_unlock(&sbi->s_lock);
+
+    assoofs_bitmap_dirty(sb, sbi->s_inode_bitmap, inode_no, 1);
+    return 0;
+}
+
+/*
+ * Reserva un rango de hasta wanted bloques libres consecutivos, empezando en
+ * goal si está libre y si no en el siguiente bloque libre a partir de la
+ * última reserva. Devuelve en *block el primero y en *count cuántos se han
+ * conseguido (al menos uno). Lo apartado para páginas diferidas
+ * (s_reserved_blocks) solo lo puede usar el volcado de esas páginas, que
+ * lo indica en su manejador con h_delalloc.
+ */
+int assoofs_sb_get_freeblocks(struct super_block *sb, uint64_t goal, uint32_t wanted, uint64_t *block, uint32_t *count)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *afs_sb = sbi->s_as;
+    struct assoofs_handle *handle = assoofs_current_handle(sb);
+    uint64_t avail;
+    uint64_t i;
+    uint32_t n;
+
+    spin_lock(&sbi->s_lock);
+    avail = afs_sb->free_blocks;
+    if (!handle || !handle->h_delalloc)
+    {
+        avail -= min(avail, sbi->s_reserved_blocks);
+    }
+    if (!avail)
+    {
+        spin_unlock(&sbi->s_lock);
+        return -ENOSPC;
+    }
+    wanted = min_t(uint64_t, wanted, avail);
+
+    i = assoofs_bitmap_find_zero(sb, sbi->s_block_bitmap, afs_sb->blocks_count, goal ? goal : sbi->s_block_hint);
+    if (i >= afs_sb->blocks_count)
+    {
+        spin_unlock(&sbi->s_lock);
+        printk(KERN_ERR "No free blocks available\n");
+        return -ENOSPC;
+    }
+
+    for (n = 1; n < wanted && i + n < afs_sb->blocks_count; n++)
+    {
+        if (assoofs_bitmap_test(sb, sbi->s_block_bitmap, i + n))
+        {
+            break;
+        }
+    }
+    assoofs_bitmap_set(sb, sbi->s_block_bitmap, i, n, true);
+    afs_sb->free_blocks -= n;
+    sbi->s_sb_dirty = true;
+    sbi->s_block_hint = i + n;
+    spin_unlock(&sbi->s_lock);
+
+    assoofs_bitmap_dirty(sb, sbi->s_block_bitmap, i, n);
+
+    *block = i;
+    *count = n;
+    return 0;
+}
+
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block)
+{
+    uint32_t count;
+
+    return assoofs_sb_get_freeblocks(sb, 0, 1, block, &count);
+}
+
+int assoofs_sb_set_freeblocks(struct super_block *sb, uint64_t block, uint32_t count){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_as;
+
+    if (block < assoofs_sb->first_data_block || block + count > assoofs_sb->blocks_count){
+        printk(KERN_ERR "assoofs: trying to free invalid blocks %llu-%llu\n", block, block + count - 1);
+        return -EINVAL;
+    }
+
+    spin_lock(&sbi->s_lock);
+    assoofs_bitmap_set(sb, sbi->s_block_bitmap, block, count, false);
+    assoofs_sb->free_blocks += count;
+    sbi->s_sb_dirty = true;
+    spin_unlock(&sbi->s_lock);
+
+    assoofs_bitmap_dirty(sb, sbi->s_block_bitmap, block, count);
+    return 0;
+}
+
+int assoofs_sb_set_a_freeblock(struct super_block *sb, uint64_t block){
+    return assoofs_sb_set_freeblocks(sb, block, 1);
+}
+
+/*
+ * Asignación diferida: al escribir en una página sin bloques solo se apartan
+ * del espacio libre (s_reserved_blocks) los bloques que ocupa la página y se
+ * marca con PG_checked. Mientras un fichero tiene páginas diferidas se aparta
+ * además un bloque para el bloque de extents que puede necesitar al
+ * asignarlas. Los bloques de verdad se reservan al volcar la página, junto
+ * con los de las páginas diferidas que la siguen, y entonces se devuelven sus
+ * reservas.
+ */
+static int assoofs_page_reserve(struct inode *inode, struct page *page)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(inode->i_sb);
+    struct assoofs_inode *ai = ASSOOFS_INODE(inode);
+    unsigned int blocks;
+    int ret = 0;
+
+    spin_lock(&sbi->s_lock);
+    if (!PageChecked(page))
+    {
+        blocks = assoofs_page_blocks(inode->i_sb) + !ai->i_da_pages;
+        if (sbi->s_as->free_blocks < sbi->s_reserved_blocks + blocks)
+        {
+            ret = -ENOSPC;
+        }
+        else
+        {
+            SetPageChecked(page);
+            sbi->s_reserved_blocks += blocks;
+            ai->i_da_pages++;
+        }
+    }
+    spin_unlock(&sbi->s_lock);
+    return ret;
+}
+
+// Devuelve la reserva de la página si la tiene (ya tiene bloque o se descarta sin escribirse)
+static void assoofs_page_unreserve(struct inode *inode, struct page *page)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(inode->i_sb);
+    struct assoofs_inode *ai = ASSOOFS_INODE(inode);
+
+    if (!PageChecked(page))
+    {
+        return;
+    }
+    spin_lock(&sbi->s_lock);
+    if (PageChecked(page))
+    {
+        ClearPageChecked(page);
+        ai->i_da_pages--;
+        // Con la última página diferida se devuelve también lo del bloque de extents
+        sbi->s_reserved_blocks -= assoofs_page_blocks(inode->i_sb) + !ai->i_da_pages;
+    }
+    spin_unlock(&sbi->s_lock);
+}
+
+// Lee y deja en memoria los bloques de un mapa de bits durante todo el montaje
+static struct buffer_head **assoofs_load_bitmap(struct super_block *sb, uint64_t first, uint64_t count)
+{
+    struct buffer_head **bitmap;
+    uint64_t i;
+
+    bitmap = kcalloc(count, sizeof(*bitmap), GFP_KERNEL);
+    if (!bitmap)
+    {
+        return NULL;
+    }
+    for (i = 0; i < count; i++)
+    {
+        bitmap[i] = sb_bread(sb, first + i);
+        if (!bitmap[i])
+        {
+            while (i--)
+            {
+                brelse(bitmap[i]);
+            }
+            kfree(bitmap);
+            return NULL;
+        }
+    }
+    return bitmap;
+}
+
+static void assoofs_release_bitmap(struct buffer_head **bitmap, uint64_t count)
+{
+    uint64_t i;
+
+    if (!bitmap)
+    {
+        return;
+    }
+    for (i = 0; i < count; i++)
+    {
+        brelse(bitmap[i]);
+    }
+    kfree(bitmap);
+}
+
+/*
+ *  Extents
+ */
+
+// Copia en extents[] la lista completa de extents del inodo (los del inodo y los del bloque de extents)
+static int assoofs_read_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, struct assoofs_extent *extents)
+{
+    struct buffer_head *bh;
+    struct assoofs_extent_block *eb;
+    uint32_t n;
+
+    n = min_t(uint32_t, inode_info->extent_count, ASSOOFS_INODE_EXTENTS);
+    memcpy(extents, inode_info->extents, n * sizeof(*extents));
+
+    if (inode_info->extent_count <= ASSOOFS_INODE_EXTENTS)
+    {
+        return n;
+    }
+
+    bh = assoofs_bread(sb, inode_info->extent_block);
+    if (!bh)
+    {
+        return -EIO;
+    }
+    eb = (struct assoofs_extent_block *)bh->b_data;
+    memcpy(extents + n, eb->eb_extents, (inode_info->extent_count - n) * sizeof(*extents));
+    brelse(bh);
+
+    return inode_info->extent_count;
+}
+
+// Libera bloques de un inodo: los de un directorio son metadatos y pueden estar en el diario
+static void assoofs_free_inode_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t block, uint32_t count)
+{
+    uint32_t i;
+
+    if (S_ISDIR(inode_info->mode))
+    {
+        for (i = 0; i < count; i++)
+        {
+            assoofs_journal_forget(sb, block + i);
+        }
+    }
+    assoofs_sb_set_freeblocks(sb, block, count);
+}
+
+// Guarda count extents en el inodo y, si no caben, en su bloque de extents (que se reserva o libera según haga falta)
+static int assoofs_write_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, struct assoofs_extent *extents, uint32_t count)
+{
+    struct buffer_head *bh;
+    struct assoofs_extent_block *eb;
+    uint32_t n;
+
+    if (count > ASSOOFS_MAX_EXTENTS(sb->s_blocksize))
+    {
+        printk(KERN_ERR "assoofs: inode %llu has too many extents\n", inode_info->inode_no);
+        return -ENOSPC;
+    }
+
+    n = min_t(uint32_t, count, ASSOOFS_INODE_EXTENTS);
+    memcpy(inode_info->extents, extents, n * sizeof(*extents));
+    memset(inode_info->extents + n, 0, (ASSOOFS_INODE_EXTENTS - n) * sizeof(*extents));
+
+    if (count <= ASSOOFS_INODE_EXTENTS)
+    {
+        if (inode_info->extent_block)
+        {
+            assoofs_journal_forget(sb, inode_info->extent_block);
+            assoofs_sb_set_a_freeblock(sb, inode_info->extent_block);
+            inode_info->extent_block = 0;
+        }
+        inode_info->extent_count = count;
+        return 0;
+    }
+
+    if (!inode_info->extent_block && assoofs_sb_get_a_freeblock(sb, &inode_info->extent_block))
+    {
+        return -ENOSPC;
+    }
+
+    bh = sb_getblk(sb, inode_info->extent_block);
+    if (!bh)
+    {
+        return -EIO;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    eb = (struct assoofs_extent_block *)bh->b_data;
+    eb->eb_count = count - n;
+    memcpy(eb->eb_extents, extents + n, (count - n) * sizeof(*extents));
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    assoofs_journal_dirty(sb, bh);
+    brelse(bh);
+
+    inode_info->extent_count = count;
+    return 0;
+}
+
+// Bloques físicos que ocupa un extent (los de un cluster comprimido son menos que los lógicos)
+static inline uint32_t assoofs_ext_pblocks(struct assoofs_extent *ext)
+{
+    return (ext->ee_flags & ASSOOFS_EXT_COMPRESSED) ? ext->ee_plen : ext->ee_len;
+}
+
+// Posición del primer extent que termina después de iblock (el que lo contiene o el siguiente)
+static uint32_t assoofs_search_extents(struct assoofs_extent *extents, uint32_t count, uint32_t iblock)
+{
+    uint32_t lo = 0, hi = count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if ((uint64_t)extents[mid].ee_block + extents[mid].ee_len <= iblock)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Traduce el bloque lógico iblock a bloque físico. Si está asignado deja en
+ * *pblock el bloque físico y en *count cuántos bloques consecutivos quedan en
+ * el extent, y si unwritten no es NULL indica si el extent está sin escribir.
+ * Si es un hueco *pblock vale 0 y *count es la longitud del hueco (0 si
+ * llega hasta el final del fichero). Los bloques de un cluster comprimido no
+ * se pueden leer uno a uno: para ellos *pblock es el primer bloque de los
+ * datos comprimidos y solo sirve para saber que hay datos.
+ */
+static int assoofs_map_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t iblock, uint64_t *pblock, uint32_t *count, bool *unwritten)
+{
+    struct assoofs_extent *extents;
+    struct assoofs_extent *ext;
+    int n;
+    uint32_t i;
+
+    *pblock = 0;
+    *count = 0;
+    if (unwritten)
+    {
+        *unwritten = false;
+    }
+
+    if (inode_info->extent_count <= ASSOOFS_INODE_EXTENTS)
+    {
+        extents = inode_info->extents;
+        n = inode_info->extent_count;
+    }
+    else
+    {
+        extents = kmalloc_array(ASSOOFS_MAX_EXTENTS(sb->s_blocksize), sizeof(*extents), GFP_NOFS);
+        if (!extents)
+        {
+            return -ENOMEM;
+        }
+        n = assoofs_read_extents(sb, inode_info, extents);
+        if (n < 0)
+        {
+            kfree(extents);
+            return n;
+        }
+    }
+
+    i = assoofs_search_extents(extents, n, iblock);
+    if (i < n)
+    {
+        ext = &extents[i];
+        if (ext->ee_block <= iblock)
+        {
+            *pblock = ext->ee_start;
+            if (!(ext->ee_flags & ASSOOFS_EXT_COMPRESSED))
+            {
+                *pblock += iblock - ext->ee_block;
+            }
+            *count = ext->ee_len - (iblock - ext->ee_block);
+            if (unwritten)
+            {
+                *unwritten = ext->ee_flags & ASSOOFS_EXT_UNWRITTEN;
+            }
+        }
+        else
+        {
+            *count = ext->ee_block - iblock;
+        }
+    }
+
+    if (extents != inode_info->extents)
+    {
+        kfree(extents);
+    }
+    return 0;
+}
+
+// Copia en *ext el extent que contiene iblock (-ENODATA si es un hueco)
+static int assoofs_find_extent(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t iblock, struct assoofs_extent *ext)
+{
+    struct assoofs_extent *extents;
+    uint32_t i;
+    int n;
+    int ret = -ENODATA;
+
+    extents = kmalloc_array(ASSOOFS_MAX_EXTENTS(sb->s_blocksize), sizeof(*extents), GFP_NOFS);
+    if (!extents)
+    {
+        return -ENOMEM;
+    }
+    n = assoofs_read_extents(sb, inode_info, extents);
+    if (n < 0)
+    {
+        kfree(extents);
+        return n;
+    }
+
+    i = assoofs_search_extents(extents, n, iblock);
+    if (i < n && extents[i].ee_block <= iblock)
+    {
+        *ext = extents[i];
+        ret = 0;
+    }
+    kfree(extents);
+    return ret;
+}
+
+/*
+ * Reserva plen bloques físicos seguidos para guardar comprimido el cluster
+ * que empieza en el bloque lógico iblock (que no debe tener bloques) y añade
+ * su extent ASSOOFS_EXT_COMPRESSED. Si no quedan tantos bloques seguidos
+ * devuelve -ENOSPC sin cambiar nada.
+ */
+static int assoofs_alloc_cluster(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t iblock, uint32_t plen, uint64_t *pblock)
+{
+    struct assoofs_extent *extents;
+    uint64_t goal = 0;
+    uint64_t block;
+    uint32_t got;
+    uint32_t i;
+    int n;
+    int ret;
+
+    extents = kmalloc_array(ASSOOFS_MAX_EXTENTS(sb->s_blocksize) + 1, sizeof(*extents), GFP_NOFS);
+    if (!extents)
+    {
+        return -ENOMEM;
+    }
+    n = assoofs_read_extents(sb, inode_info, extents);
+    if (n < 0)
+    {
+        kfree(extents);
+        return n;
+    }
+
+    i = assoofs_search_extents(extents, n, iblock);
+    if (i > 0)
+    {
+        goal = extents[i - 1].ee_start + assoofs_ext_pblocks(&extents[i - 1]);
+    }
+    ret = assoofs_sb_get_freeblocks(sb, goal, plen, &block, &got);
+    if (ret)
+    {
+        kfree(extents);
+        return ret;
+    }
+    if (got < plen)
+    {
+        assoofs_sb_set_freeblocks(sb, block, got);
+        kfree(extents);
+        return -ENOSPC;
+    }
+
+    memmove(&extents[i + 1], &extents[i], (n - i) * sizeof(*extents));
+    memset(&extents[i], 0, sizeof(*extents));
+    extents[i].ee_block = iblock;
+    extents[i].ee_len = ASSOOFS_CLUSTER_BLOCKS;
+    extents[i].ee_start = block;
+    extents[i].ee_flags = ASSOOFS_EXT_COMPRESSED;
+    extents[i].ee_plen = plen;
+    n++;
+
+    ret = assoofs_write_extents(sb, inode_info, extents, n);
+    kfree(extents);
+    if (ret)
+    {
+        assoofs_sb_set_freeblocks(sb, block, plen);
+        return ret;
+    }
+
+    *pblock = block;
+    return 0;
+}
+
+/*
+ * Reserva hasta wanted bloques físicos contiguos para los bloques lógicos a
+ * partir de iblock (que no deben estar asignados) y los añade a la lista de
+ * extents con las marcas flags, juntándolos con el extent anterior si quedan
+ * contiguos. Se intenta colocarlos justo detrás del extent anterior para que
+ * el fichero crezca de forma secuencial en disco.
+ */
+static int assoofs_alloc_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t iblock, uint32_t wanted, uint32_t flags, uint64_t *pblock, uint32_t *count)
+{
+    struct assoofs_extent *extents;
+    struct assoofs_extent *prev = NULL;
+    uint64_t goal = 0;
+    uint64_t block;
+    uint32_t got;
+    uint32_t i;
+    int n;
+    int ret;
+
+    extents = kmalloc_array(ASSOOFS_MAX_EXTENTS(sb->s_blocksize) + 1, sizeof(*extents), GFP_NOFS);
+    if (!extents)
+    {
+        return -ENOMEM;
+    }
+    n = assoofs_read_extents(sb, inode_info, extents);
+    if (n < 0)
+    {
+        kfree(extents);
+        return n;
+    }
+
+    i = assoofs_search_extents(extents, n, iblock);
+    if (i < n && extents[i].ee_block - iblock < wanted)
+    {
+        // No pisar el extent siguiente
+        wanted = extents[i].ee_block - iblock;
+    }
+    if (i > 0)
+    {
+        prev = &extents[i - 1];
+        goal = prev->ee_start + assoofs_ext_pblocks(prev);
+    }
+
+    ret = assoofs_sb_get_freeblocks(sb, goal, wanted, &block, &got);
+    if (ret)
+    {
+        kfree(extents);
+        return ret;
+    }
+
+    if (prev && prev->ee_block + prev->ee_len == iblock && prev->ee_start + prev->ee_len == block && prev->ee_flags == flags &&
+        prev->ee_len <= U32_MAX - got)
+    {
+        prev->ee_len += got;
+    }
+    else
+    {
+        memmove(&extents[i + 1], &extents[i], (n - i) * sizeof(*extents));
+        memset(&extents[i], 0, sizeof(*extents));
+        extents[i].ee_block = iblock;
+        extents[i].ee_len = got;
+        extents[i].ee_start = block;
+        extents[i].ee_flags = flags;
+        n++;
+    }
+
+    ret = assoofs_write_extents(sb, inode_info, extents, n);
+    kfree(extents);
+    if (ret)
+    {
+        assoofs_sb_set_freeblocks(sb, block, got);
+        return ret;
+    }
+
+    *pblock = block;
+    *count = got;
+    return 0;
+}
+
+// Libera todos los bloques de datos del inodo y su bloque de extents
+static void assoofs_free_extents(struct super_block *sb, struct assoofs_inode_info *inode_info)
+{
+    struct assoofs_extent *extents;
+    int n;
+    int i;
+
+    extents = kmalloc_array(ASSOOFS_MAX_EXTENTS(sb->s_blocksize), sizeof(*extents), GFP_NOFS);
+    if (!extents)
+    {
+        return;
+    }
+    n = assoofs_read_extents(sb, inode_info, extents);
+    for (i = 0; i < n; i++)
+    {
+        assoofs_free_inode_blocks(sb, inode_info, extents[i].ee_start, assoofs_ext_pblocks(&extents[i]));
+    }
+    kfree(extents);
+
+    if (inode_info->extent_block)
+    {
+        assoofs_journal_forget(sb, inode_info->extent_block);
+        assoofs_sb_set_a_freeblock(sb, inode_info->extent_block);
+        inode_info->extent_block = 0;
+    }
+    inode_info->extent_count = 0;
+    memset(inode_info->extents, 0, sizeof(inode_info->extents));
+}
+
+// Junta los extents que siguen seguidos en el fichero y en disco y tienen las mismas marcas (los clusters comprimidos van siempre solos)
+static int assoofs_merge_extents(struct assoofs_extent *extents, int n)
+{
+    struct assoofs_extent *prev;
+    int i, out = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        prev = out ? &extents[out - 1] : NULL;
+        if (prev && !(prev->ee_flags & ASSOOFS_EXT_COMPRESSED) && prev->ee_block + prev->ee_len == extents[i].ee_block && prev->ee_start + prev->ee_len == extents[i].ee_start &&
+            prev->ee_flags == extents[i].ee_flags && prev->ee_len <= U32_MAX - extents[i].ee_len)
+        {
+            prev->ee_len += extents[i].ee_len;
+            continue;
+        }
+        extents[out++] = extents[i];
+    }
+    return out;
+}
+
+/*
+ * Libera los bloques de datos de los bloques lógicos start..end-1 (end puede
+ * pasar de U32_MAX para llegar hasta el final). Un extent que cruza start o
+ * end se recorta y uno que los contiene a los dos se parte en dos. Los
+ * clusters comprimidos no se pueden partir: solo se quitan si caen enteros
+ * dentro del rango, así que con ficheros comprimidos start y end deben ser
+ * múltiplos de ASSOOFS_CLUSTER_BLOCKS.
+ */
+static int assoofs_remove_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t start, uint64_t end)
+{
+    struct assoofs_extent *extents;
+    struct assoofs_extent *ext;
+    uint64_t ext_end;
+    uint32_t cut;
+    int n, i, out;
+    int ret;
+
+    if (start >= end || start > U32_MAX)
+    {
+        return 0;
+    }
+
+    extents = kmalloc_array(ASSOOFS_MAX_EXTENTS(sb->s_blocksize) + 1, sizeof(*extents), GFP_NOFS);
+    if (!extents)
+    {
+        return -ENOMEM;
+    }
+    n = assoofs_read_extents(sb, inode_info, extents);
+    if (n < 0)
+    {
+        kfree(extents);
+        return n;
+    }
+
+    i = assoofs_search_extents(extents, n, start);
+    if (i < n && extents[i].ee_block < start && (uint64_t)extents[i].ee_block + extents[i].ee_len > end)
+    {
+        // El hueco cae dentro de un único extent: queda partido en dos
+        if (extents[i].ee_flags & ASSOOFS_EXT_COMPRESSED)
+        {
+            kfree(extents);
+            return 0;
+        }
+        if (n >= ASSOOFS_MAX_EXTENTS(sb->s_blocksize))
+        {
+            kfree(extents);
+            return -ENOSPC;
+        }
+        ext = &extents[i];
+        memmove(&extents[i + 1], &extents[i], (n - i) * sizeof(*extents));
+        n++;
+        cut = end - ext->ee_block;
+        extents[i + 1].ee_block = end;
+        extents[i + 1].ee_start = ext->ee_start + cut;
+        extents[i + 1].ee_len = ext->ee_len - cut;
+        ext->ee_len = start - ext->ee_block;
+        assoofs_free_inode_blocks(sb, inode_info, ext->ee_start + ext->ee_len, cut - ext->ee_len);
+        ret = assoofs_write_extents(sb, inode_info, extents, n);
+        kfree(extents);
+        return ret;
+    }
+
+    out = i;
+    if (i < n && extents[i].ee_block < start)
+    {
+        // El extent que contiene start se recorta por detrás
+        ext = &extents[i];
+        cut = start - ext->ee_block;
+        if (!(ext->ee_flags & ASSOOFS_EXT_COMPRESSED))
+        {
+            assoofs_free_inode_blocks(sb, inode_info, ext->ee_start + cut, ext->ee_len - cut);
+            ext->ee_len = cut;
+        }
+        out = ++i;
+    }
+    for (; i < n && extents[i].ee_block < end; i++)
+    {
+        ext = &extents[i];
+        ext_end = (uint64_t)ext->ee_block + ext->ee_len;
+        if (ext_end <= end)
+        {
+            assoofs_free_inode_blocks(sb, inode_info, ext->ee_start, assoofs_ext_pblocks(ext));
+            continue;
+        }
+        if (ext->ee_flags & ASSOOFS_EXT_COMPRESSED)
+        {
+            break;
+        }
+        // El extent que contiene end se recorta por delante
+        cut = end - ext->ee_block;
+        assoofs_free_inode_blocks(sb, inode_info, ext->ee_start, cut);
+        ext->ee_block += cut;
+        ext->ee_start += cut;
+        ext->ee_len -= cut;
+        break;
+    }
+    memmove(&extents[out], &extents[i], (n - i) * sizeof(*extents));
+    n = out + (n - i);
+
+    ret = assoofs_write_extents(sb, inode_info, extents, n);
+    kfree(extents);
+    return ret;
+}
+
+// Libera los bloques de datos a partir del bloque lógico first (para truncar el fichero)
+static int assoofs_truncate_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t first)
+{
+    return assoofs_remove_extents(sb, inode_info, first, (uint64_t)U32_MAX + 1);
+}
+
+/*
+ * Marca como escritos los bloques lógicos first..first+count-1 de los
+ * extents sin escribir que haya en ese rango. Cada extent afectado se parte
+ * en la parte escrita y lo que queda sin escribir antes y después, y se
+ * juntan los que quedan seguidos. Se llama cuando los datos del rango ya
+ * están en el disco. Si la lista de extents no da para tanto se escriben
+ * ceros en lo que queda sin escribir del extent y se marca entero como
+ * escrito, salvo que haya otros buffers esperando su conversión (que podrían
+ * estar escribiendo en esa parte): entonces -ENOSPC.
+ */
+static int assoofs_convert_unwritten(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t first, uint32_t count)
+{
+    struct assoofs_extent *extents;
+    struct assoofs_extent pieces[3];
+    struct assoofs_extent *ext;
+    uint64_t end = (uint64_t)first + count;
+    uint32_t head, tail;
+    int n, i, np;
+    int ret = 0;
+
+    extents = kmalloc_array(ASSOOFS_MAX_EXTENTS(sb->s_blocksize) + 2, sizeof(*extents), GFP_NOFS);
+    if (!extents)
+    {
+        return -ENOMEM;
+    }
+    n = assoofs_read_extents(sb, inode_info, extents);
+    if (n < 0)
+    {
+        kfree(extents);
+        return n;
+    }
+
+    for (i = assoofs_search_extents(extents, n, first); i < n && extents[i].ee_block < end; i++)
+    {
+        ext = &extents[i];
+        if (!(ext->ee_flags & ASSOOFS_EXT_UNWRITTEN))
+        {
+            continue;
+        }
+        head = ext->ee_block < first ? first - ext->ee_block : 0;
+        tail = (uint64_t)ext->ee_block + ext->ee_len > end ? (uint64_t)ext->ee_block + ext->ee_len - end : 0;
+        if (n + !!head + !!tail > ASSOOFS_MAX_EXTENTS(sb->s_blocksize))
+        {
+            // Sin sitio para partirlo: el extent entero pasa a escrito con ceros delante y detrás de lo escrito
+            if (atomic_read(&container_of(inode_info, struct assoofs_inode, info)->i_unwritten_io))
+            {
+                ret = -ENOSPC;
+                break;
+            }
+            ret = head ? sb_issue_zeroout(sb, ext->ee_start, head, GFP_NOFS) : 0;
+            if (!ret && tail)
+            {
+                ret = sb_issue_zeroout(sb, ext->ee_start + ext->ee_len - tail, tail, GFP_NOFS);
+            }
+            if (ret)
+            {
+                break;
+            }
+            ext->ee_flags &= ~ASSOOFS_EXT_UNWRITTEN;
+            continue;
+        }
+
+        np = 0;
+        if (head)
+        {
+            pieces[np] = *ext;
+            pieces[np++].ee_len = head;
+        }
+        pieces[np] = *ext;
+        pieces[np].ee_block += head;
+        pieces[np].ee_start += head;
+        pieces[np].ee_len -= head + tail;
+        pieces[np++].ee_flags &= ~ASSOOFS_EXT_UNWRITTEN;
+        if (tail)
+        {
+            pieces[np] = *ext;
+            pieces[np].ee_block += ext->ee_len - tail;
+            pieces[np].ee_start += ext->ee_len - tail;
+            pieces[np++].ee_len = tail;
+        }
+        memmove(&extents[i + np], &extents[i + 1], (n - i - 1) * sizeof(*extents));
+        memcpy(&extents[i], pieces, np * sizeof(*extents));
+        n = assoofs_merge_extents(extents, n + np - 1);
+        // Al juntar cambian las posiciones: se sigue desde el extent que contiene lo recién escrito
+        i = assoofs_search_extents(extents, n, pieces[head ? 1 : 0].ee_block);
+    }
+
+    if (!ret)
+    {
+        ret = assoofs_write_extents(sb, inode_info, extents, assoofs_merge_extents(extents, n));
+    }
+    kfree(extents);
+    return ret;
+}
+
+/*
+ *  Operaciones sobre ficheros
+*/
+
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *iattr);
+static ssize_t assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static int assoofs_file_mmap(struct file *file, struct vm_area_struct *vma);
+static long assoofs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+static loff_t assoofs_file_llseek(struct file *file, loff_t offset, int whence);
+
+// Además de los datos y el inodo, las reservas de bloques del fichero pueden estar en la transacción en curso
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    int ret;
+
+    ret = generic_file_fsync(file, start, end, datasync);
+    if (ret)
+    {
+        return ret;
+    }
+    return assoofs_journal_force(file_inode(file)->i_sb, false);
+}
+
+const struct file_operations assoofs_file_operations = {
+    .llseek = assoofs_file_llseek,
+    .read_iter = assoofs_file_read_iter,
+    .write_iter = assoofs_file_write_iter,
+    .mmap = assoofs_file_mmap,
+    .fsync = assoofs_fsync,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .fallocate = assoofs_fallocate,
+};
+
+static const struct inode_operations assoofs_file_inode_ops = {
+    .setattr = assoofs_setattr,
+};
+
+/*
+ * Los bloques de las páginas diferidas se reservan todos juntos al volcar la
+ * primera: a partir de iblock se cuentan los bloques que quedan de su página
+ * (si es diferida) y los de las páginas que la siguen sucias y con reserva,
+ * sin pasar del final del fichero. Cada página tiene assoofs_page_blocks
+ * bloques, uno si el bloque es del tamaño de la página. Devuelve 0 si la
+ * página de iblock no es diferida.
+ */
+#define ASSOOFS_DELALLOC_MAX 1024
+
+static uint32_t assoofs_delalloc_run(struct inode *inode, uint32_t iblock)
+{
+    unsigned int shift = PAGE_SHIFT - inode->i_blkbits;
+    uint64_t end = DIV_ROUND_UP(i_size_read(inode), i_blocksize(inode));
+    pgoff_t index = iblock >> shift;
+    struct page *page;
+    uint64_t next;
+    uint32_t n;
+    bool delayed;
+
+    for (n = 0; n < ASSOOFS_DELALLOC_MAX; n++)
+    {
+        page = find_get_page(inode->i_mapping, index + n);
+        if (!page)
+        {
+            break;
+        }
+        // La página que se está volcando ya no está sucia
+        delayed = PageChecked(page) && (n == 0 || PageDirty(page));
+        put_page(page);
+        if (!delayed)
+        {
+            break;
+        }
+    }
+    if (!n)
+    {
+        return 0;
+    }
+
+    next = min3((uint64_t)(index + n) << shift, end, (uint64_t)U32_MAX + 1);
+    return next > iblock ? next - iblock : 1;
+}
+
+/*
+ * Los bloques first..first+count-1 ya están asignados: las páginas cuyo
+ * último bloque (o el último antes del final del fichero) está entre ellos
+ * devuelven su reserva.
+ */
+static void assoofs_delalloc_release(struct inode *inode, uint32_t first, uint32_t count)
+{
+    unsigned int shift = PAGE_SHIFT - inode->i_blkbits;
+    uint64_t end = DIV_ROUND_UP(i_size_read(inode), i_blocksize(inode));
+    uint64_t stop = (uint64_t)first + count;
+    struct page *page;
+    uint64_t last;
+    pgoff_t index;
+
+    for (index = first >> shift; ((uint64_t)index << shift) < stop; index++)
+    {
+        last = ((uint64_t)(index + 1) << shift) - 1;
+        if (last >= end && end > ((uint64_t)index << shift))
+        {
+            last = end - 1;
+        }
+        if (last < first || last >= stop)
+        {
+            continue;
+        }
+        page = find_get_page(inode->i_mapping, index);
+        if (page)
+        {
+            assoofs_page_unreserve(inode, page);
+            put_page(page);
+        }
+    }
+}
+
+/*
+ * Traduce un bloque lógico del fichero a bloque físico para la caché de
+ * páginas. Con create se reservan los bloques que falten (al volcar páginas
+ * diferidas, también los de las siguientes). Si se pide más de
+ * un bloque (bh_result->b_size, como hace mpage_readahead) se devuelve todo
+ * el tramo contiguo del extent que quepa, para que la lectura vaya en un solo
+ * bio sin volver a recorrer los extents bloque a bloque. Los bloques sin
+ * escribir se leen como huecos. Al escribir en uno el buffer queda
+ * BH_Unwritten y el extent solo pasa a escrito cuando los datos están en el
+ * disco (assoofs_end_buffer_unwritten): si se confirmara antes, tras una
+ * caída se leería lo que hubiera en el bloque.
+ */
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    uint64_t pblock;
+    uint32_t count, run;
+    bool unwritten;
+    int ret, err;
+
+    if (iblock > U32_MAX)
+    {
+        return -EFBIG;
+    }
+
+    down_read(ASSOOFS_DATA_SEM(inode));
+    ret = assoofs_map_block(sb, inode_info, iblock, &pblock, &count, &unwritten);
+    up_read(ASSOOFS_DATA_SEM(inode));
+    if (ret)
+    {
+        return ret;
+    }
+    if (unwritten && !create)
+    {
+        return 0;
+    }
+    if (pblock && !unwritten)
+    {
+        size_t max_blocks = bh_result->b_size >> inode->i_blkbits;
+
+        map_bh(bh_result, sb, pblock);
+        if (max_blocks > 1)
+        {
+            bh_result->b_size = min_t(size_t, max_blocks, count) << inode->i_blkbits;
+        }
+        if (create)
+        {
+            // Una página diferida que otro volcado ya ha asignado no puede conservar su reserva
+            assoofs_delalloc_release(inode, iblock, 1);
+        }
+        return 0;
+    }
+    if (!create)
+    {
+        return 0;
+    }
+
+    handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+    down_write(ASSOOFS_DATA_SEM(inode));
+    // Otro hilo (por ejemplo la escritura de páginas de un mmap) puede haberlo reservado ya
+    ret = assoofs_map_block(sb, inode_info, iblock, &pblock, &count, &unwritten);
+    if (!ret && unwritten)
+    {
+        // Lo que no cubra la escritura se pone a cero en la página (buffer nuevo), no se lee del disco
+        atomic_inc(&ASSOOFS_INODE(inode)->i_unwritten_io);
+        assoofs_delalloc_release(inode, iblock, 1);
+        set_buffer_new(bh_result);
+        set_buffer_unwritten(bh_result);
+    }
+    else if (!ret && !pblock)
+    {
+        // Solo el volcado de páginas diferidas puede usar lo que tienen apartado
+        run = assoofs_delalloc_run(inode, iblock);
+        handle->h_delalloc = run != 0;
+        ret = assoofs_alloc_blocks(sb, inode_info, iblock, max(run, 1U), 0, &pblock, &count);
+        handle->h_delalloc = false;
+        if (!ret)
+        {
+            assoofs_save_inode_info(sb, inode_info);
+            assoofs_delalloc_release(inode, iblock, count);
+            // Todo el tramo es nuevo, no solo el bloque de bh_result: fuera de la caché del dispositivo lo que hubiera
+            clean_bdev_aliases(sb->s_bdev, pblock, count);
+            set_buffer_new(bh_result);
+        }
+    }
+    up_write(ASSOOFS_DATA_SEM(inode));
+    err = assoofs_journal_stop(handle);
+    ret = ret ? ret : err;
+    if (ret)
+    {
+        return ret;
+    }
+
+    map_bh(bh_result, sb, pblock);
+    return 0;
+}
+
+/*
+ *  Datos en línea
+ *
+ * Mientras el fichero tiene ASSOOFS_INODE_INLINE sus datos están en
+ * inline_data y la página 0 es solo una copia que nunca se ensucia: cada
+ * escritura se copia al inodo en write_end y va al diario con él. La marca
+ * solo se quita (nunca se vuelve a poner) y siempre con la página 0
+ * bloqueada, así que quien tiene esa página bloqueada ve una marca estable.
+ */
+
+// Rellena la página con los datos del inodo y ceros detrás
+static void assoofs_read_inline_folio(struct inode *inode, struct folio *folio)
+{
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    size_t len = 0;
+    void *kaddr;
+
+    kaddr = kmap_local_folio(folio, 0);
+    down_read(ASSOOFS_DATA_SEM(inode));
+    if (folio->index == 0)
+    {
+        len = min_t(size_t, inode_info->file_size, ASSOOFS_INLINE_DATA_MAX);
+        memcpy(kaddr, inode_info->inline_data, len);
+    }
+    up_read(ASSOOFS_DATA_SEM(inode));
+    memset(kaddr + len, 0, PAGE_SIZE - len);
+    kunmap_local(kaddr);
+    flush_dcache_folio(folio);
+    folio_mark_uptodate(folio);
+}
+
+/*
+ * Pasa el fichero a bloques: con la página 0 al día se quita la marca, se
+ * reserva su bloque y la página queda sucia para que los datos lleguen al
+ * disco con la escritura normal de páginas.
+ */
+static int assoofs_inline_convert(struct inode *inode)
+{
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    struct page *page;
+    unsigned int len;
+    void *kaddr;
+    int ret, err;
+
+    page = grab_cache_page(inode->i_mapping, 0);
+    if (!page)
+    {
+        return -ENOMEM;
+    }
+    // Otro hilo puede haberlo convertido mientras se esperaba la página
+    if (!assoofs_has_inline_data(inode_info))
+    {
+        ret = 0;
+        goto out;
+    }
+    if (!PageUptodate(page))
+    {
+        assoofs_read_inline_folio(inode, page_folio(page));
+    }
+
+    handle = assoofs_journal_start(inode->i_sb, ASSOOFS_JOURNAL_CREDITS);
+    down_write(ASSOOFS_DATA_SEM(inode));
+    len = min_t(uint64_t, inode_info->file_size, ASSOOFS_INLINE_DATA_MAX);
+    inode_info->flags &= ~ASSOOFS_INODE_INLINE;
+    memset(inode_info->inline_data, 0, sizeof(inode_info->inline_data));
+    ret = assoofs_save_inode_info(inode->i_sb, inode_info);
+    up_write(ASSOOFS_DATA_SEM(inode));
+
+    if (!ret && len)
+    {
+        if (assoofs_compressed(inode_info))
+        {
+            // Las páginas de un fichero comprimido no llevan buffers: solo se reserva, como en write_begin
+            ret = assoofs_page_reserve(inode, page);
+            if (!ret)
+            {
+                set_page_dirty(page);
+            }
+        }
+        else
+        {
+            ret = __block_write_begin(page, 0, len, assoofs_get_block);
+            if (!ret)
+            {
+                block_commit_write(page, 0, len);
+            }
+        }
+        if (ret)
+        {
+            // Sin bloque los datos vuelven al inodo
+            kaddr = kmap_local_page(page);
+            down_write(ASSOOFS_DATA_SEM(inode));
+            memcpy(inode_info->inline_data, kaddr, len);
+            inode_info->flags |= ASSOOFS_INODE_INLINE;
+            assoofs_save_inode_info(inode->i_sb, inode_info);
+            up_write(ASSOOFS_DATA_SEM(inode));
+            kunmap_local(kaddr);
+        }
+    }
+    err = assoofs_journal_stop(handle);
+    ret = ret ? ret : err;
+
+out:
+    unlock_page(page);
+    put_page(page);
+    return ret;
+}
+
+// Copia al inodo lo escrito en la página 0 de un fichero en línea
+static int assoofs_write_inline_end(struct inode *inode, loff_t pos, unsigned copied, struct page *page)
+{
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    void *kaddr;
+    int ret;
+
+    handle = assoofs_journal_start(inode->i_sb, ASSOOFS_JOURNAL_CREDITS);
+    kaddr = kmap_local_page(page);
+    down_write(ASSOOFS_DATA_SEM(inode));
+    memcpy(inode_info->inline_data + pos, kaddr + pos, copied);
+    if (pos + copied > i_size_read(inode))
+    {
+        i_size_write(inode, pos + copied);
+    }
+    inode_info->file_size = i_size_read(inode);
+    assoofs_save_inode_info(inode->i_sb, inode_info);
+    up_write(ASSOOFS_DATA_SEM(inode));
+    kunmap_local(kaddr);
+
+    unlock_page(page);
+    put_page(page);
+    ret = assoofs_journal_stop(handle);
+    return ret ? ret : copied;
+}
+
+/*
+ *  Compresión
+ *
+ * Los ficheros con ASSOOFS_INODE_COMPRESSED se guardan por clusters de
+ * ASSOOFS_CLUSTER_BLOCKS bloques. Al volcar una página sucia se junta su
+ * cluster entero y se comprime con LZ4. Si así ocupa al menos un bloque
+ * menos, se guarda en un único extent ASSOOFS_EXT_COMPRESSED; si no, se
+ * guarda sin comprimir en extents normales. Al leer se descomprime el cluster
+ * entero y se copia en sus páginas. Las páginas de estos ficheros no tienen
+ * nunca buffers: lo que va al disco pasa siempre por assoofs_write_cluster.
+ */
+static inline size_t assoofs_cluster_bytes(struct inode *inode)
+{
+    return (size_t)ASSOOFS_CLUSTER_BLOCKS << inode->i_blkbits;
+}
+
+static inline unsigned int assoofs_cluster_pages(struct inode *inode)
+{
+    return assoofs_cluster_bytes(inode) >> PAGE_SHIFT;
+}
+
+// Lee los ee_plen bloques de un cluster comprimido y los descomprime en buf
+static int assoofs_decompress_cluster(struct super_block *sb, struct assoofs_extent *ext, char *buf, size_t size)
+{
+    struct assoofs_cluster_header *ch;
+    struct buffer_head *bh;
+    size_t csize = (size_t)ext->ee_plen << sb->s_blocksize_bits;
+    char *cbuf;
+    uint32_t i;
+    int ret = 0;
+
+    if (!ext->ee_plen || ext->ee_plen >= ASSOOFS_CLUSTER_BLOCKS)
+    {
+        printk(KERN_ERR "assoofs: invalid compressed cluster at block %llu\n", ext->ee_start);
+        return -EIO;
+    }
+    cbuf = kvmalloc(csize, GFP_NOFS);
+    if (!cbuf)
+    {
+        return -ENOMEM;
+    }
+
+    for (i = 1; i < ext->ee_plen; i++)
+    {
+        sb_breadahead(sb, ext->ee_start + i);
+    }
+    for (i = 0; i < ext->ee_plen; i++)
+    {
+        bh = assoofs_bread(sb, ext->ee_start + i);
+        if (!bh)
+        {
+            ret = -EIO;
+            goto out;
+        }
+        memcpy(cbuf + ((size_t)i << sb->s_blocksize_bits), bh->b_data, sb->s_blocksize);
+        brelse(bh);
+    }
+
+    ch = (struct assoofs_cluster_header *)cbuf;
+    if (ch->ch_magic != ASSOOFS_CLUSTER_MAGIC || ch->ch_size > csize - sizeof(*ch) || ch->ch_len > size ||
+        LZ4_decompress_safe(cbuf + sizeof(*ch), buf, ch->ch_size, ch->ch_len) != ch->ch_len)
+    {
+        printk(KERN_ERR "assoofs: corrupted compressed cluster at block %llu\n", ext->ee_start);
+        ret = -EIO;
+    }
+
+out:
+    kvfree(cbuf);
+    return ret;
+}
+
+/*
+ * Deja en buf el contenido del cluster cl tal como está en disco:
+ * descomprimido o leído bloque a bloque, con ceros en los huecos, en los
+ * bloques sin escribir y detrás del final del fichero.
+ */
+static int assoofs_read_cluster(struct inode *inode, pgoff_t cl, char *buf)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_extent ext;
+    struct buffer_head *bh;
+    uint64_t pblocks[ASSOOFS_CLUSTER_BLOCKS];
+    size_t size = assoofs_cluster_bytes(inode);
+    loff_t start = (loff_t)cl * size;
+    uint32_t first = cl * ASSOOFS_CLUSTER_BLOCKS;
+    uint32_t count, b;
+    bool unwritten;
+    loff_t isize;
+    int ret;
+
+    memset(buf, 0, size);
+    down_read(ASSOOFS_DATA_SEM(inode));
+    ret = assoofs_find_extent(sb, inode_info, first, &ext);
+    if (!ret && (ext.ee_flags & ASSOOFS_EXT_COMPRESSED))
+    {
+        ret = assoofs_decompress_cluster(sb, &ext, buf, size);
+    }
+    else if (!ret || ret == -ENODATA)
+    {
+        // Cluster sin comprimir (o fichero escrito antes de montar con compress): bloque a bloque
+        ret = 0;
+        for (b = 0; b < ASSOOFS_CLUSTER_BLOCKS && !ret; b++)
+        {
+            ret = assoofs_map_block(sb, inode_info, first + b, &pblocks[b], &count, &unwritten);
+            if (!ret && pblocks[b] && unwritten)
+            {
+                pblocks[b] = 0;
+            }
+            if (!ret && pblocks[b])
+            {
+                sb_breadahead(sb, pblocks[b]);
+            }
+        }
+        for (b = 0; b < ASSOOFS_CLUSTER_BLOCKS && !ret; b++)
+        {
+            if (!pblocks[b])
+            {
+                continue;
+            }
+            bh = assoofs_bread(sb, pblocks[b]);
+            if (!bh)
+            {
+                ret = -EIO;
+                break;
+            }
+            memcpy(buf + ((size_t)b << inode->i_blkbits), bh->b_data, sb->s_blocksize);
+            brelse(bh);
+        }
+    }
+    up_read(ASSOOFS_DATA_SEM(inode));
+
+    isize = i_size_read(inode);
+    if (!ret && isize < start + (loff_t)size)
+    {
+        memset(buf + max_t(loff_t, isize - start, 0), 0, start + size - max(isize, start));
+    }
+    return ret;
+}
+
+// Copia en la página su parte del cluster que hay en buf
+static void assoofs_cluster_fill_page(struct inode *inode, struct page *page, char *buf)
+{
+    size_t off = (size_t)(page->index % assoofs_cluster_pages(inode)) << PAGE_SHIFT;
+
+    memcpy_to_page(page, 0, buf + off, PAGE_SIZE);
+    SetPageUptodate(page);
+}
+
+static int assoofs_cluster_read_folio(struct inode *inode, struct folio *folio)
+{
+    char *buf;
+    int ret = -ENOMEM;
+
+    buf = kvmalloc(assoofs_cluster_bytes(inode), GFP_NOFS);
+    if (buf)
+    {
+        ret = assoofs_read_cluster(inode, folio->index / assoofs_cluster_pages(inode), buf);
+        if (!ret)
+        {
+            assoofs_cluster_fill_page(inode, &folio->page, buf);
+        }
+        kvfree(buf);
+    }
+    folio_unlock(folio);
+    return ret;
+}
+
+// Cada cluster se lee una sola vez para todas sus páginas de la ventana de lectura anticipada
+static void assoofs_cluster_readahead(struct readahead_control *rac)
+{
+    struct inode *inode = rac->mapping->host;
+    struct folio *folio;
+    pgoff_t cl = ULONG_MAX;
+    char *buf;
+    int ret = 0;
+
+    // Las páginas que no se lean aquí las lee después read_folio
+    buf = kvmalloc(assoofs_cluster_bytes(inode), GFP_NOFS);
+    if (!buf)
+    {
+        return;
+    }
+    while ((folio = readahead_folio(rac)) != NULL)
+    {
+        if (folio->index / assoofs_cluster_pages(inode) != cl)
+        {
+            cl = folio->index / assoofs_cluster_pages(inode);
+            ret = assoofs_read_cluster(inode, cl, buf);
+        }
+        if (!ret)
+        {
+            assoofs_cluster_fill_page(inode, &folio->page, buf);
+        }
+        folio_unlock(folio);
+    }
+    kvfree(buf);
+}
+
+/*
+ * Escribir en un fichero comprimido nunca asigna bloques: solo se reserva
+ * espacio como en la asignación diferida. Si la escritura no cubre la página
+ * entera, lo que falta se saca del cluster en disco.
+ */
+static int assoofs_cluster_write_begin(struct inode *inode, struct address_space *mapping, loff_t pos, unsigned len, struct page **pagep)
+{
+    unsigned from = pos & (PAGE_SIZE - 1);
+    struct page *page;
+    char *buf;
+    int ret = 0;
+
+    page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT);
+    if (!page)
+    {
+        return -ENOMEM;
+    }
+
+    if (!PageUptodate(page) && len != PAGE_SIZE)
+    {
+        if (page_offset(page) >= i_size_read(inode))
+        {
+            zero_user_segments(page, 0, from, from + len, PAGE_SIZE);
+        }
+        else
+        {
+            buf = kvmalloc(assoofs_cluster_bytes(inode), GFP_NOFS);
+            ret = buf ? assoofs_read_cluster(inode, page->index / assoofs_cluster_pages(inode), buf) : -ENOMEM;
+            if (!ret)
+            {
+                assoofs_cluster_fill_page(inode, page, buf);
+            }
+            kvfree(buf);
+        }
+    }
+    if (!ret)
+    {
+        ret = assoofs_page_reserve(inode, page);
+    }
+    if (ret)
+    {
+        unlock_page(page);
+        put_page(page);
+        return ret;
+    }
+
+    *pagep = page;
+    return 0;
+}
+
+// Memoria de trabajo de un volcado de un fichero comprimido
+struct assoofs_cluster_ctx {
+    char *buf;            /* cluster sin comprimir */
+    char *cbuf;           /* cabecera y datos comprimidos */
+    void *wrkmem;         /* memoria de trabajo de LZ4 */
+    struct page **pages;  /* páginas del cluster bloqueadas */
+};
+
+// Copia count bloques de data en los bloques físicos a partir de pblock y los manda al disco (esperando si sync)
+static int assoofs_cluster_write_blocks(struct super_block *sb, uint64_t pblock, const char *data, uint32_t count, bool sync)
+{
+    struct buffer_head *bh;
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; i < count && !ret; i++)
+    {
+        bh = sb_getblk(sb, pblock + i);
+        if (!bh)
+        {
+            return -ENOMEM;
+        }
+        lock_buffer(bh);
+        memcpy(bh->b_data, data + ((size_t)i << sb->s_blocksize_bits), sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        if (sync)
+        {
+            ret = sync_dirty_buffer(bh);
+        }
+        else
+        {
+            write_dirty_buffer(bh, 0);
+        }
+        brelse(bh);
+    }
+    return ret;
+}
+
+/*
+ * Vuelca el cluster de la página (bloqueada y ya limpia): bloquea las demás
+ * páginas del cluster que hay en la caché, completa con el disco las que
+ * falten y sustituye los bloques del cluster por los nuevos, comprimidos o
+ * no. Todas las páginas quedan limpias y sin reserva.
+ */
+static int assoofs_write_cluster(struct inode *inode, struct page *page, struct assoofs_cluster_ctx *ctx, bool sync)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_cluster_header *ch = (struct assoofs_cluster_header *)ctx->cbuf;
+    struct assoofs_handle *handle;
+    struct {
+        uint64_t pblock;
+        uint32_t count;
+    } runs[ASSOOFS_CLUSTER_BLOCKS];
+    unsigned int cp = assoofs_cluster_pages(inode);
+    size_t size = assoofs_cluster_bytes(inode);
+    pgoff_t first_page = page->index - page->index % cp;
+    loff_t start = (loff_t)first_page << PAGE_SHIFT;
+    uint32_t first = first_page / cp * ASSOOFS_CLUSTER_BLOCKS;
+    loff_t isize = i_size_read(inode);
+    uint32_t nblocks, plen = 0, b, count;
+    unsigned int i, nruns = 0;
+    bool need_read = false;
+    uint64_t pblock;
+    size_t len;
+    int clen;
+    int ret = 0, err;
+
+    // Página que ha quedado detrás del final por un truncado en curso
+    if (start >= isize)
+    {
+        assoofs_page_unreserve(inode, page);
+        unlock_page(page);
+        return 0;
+    }
+    len = min_t(loff_t, size, isize - start);
+
+    // Solo un volcado del fichero a la vez (i_cluster_mutex), así que se pueden bloquear en orden sin riesgo
+    for (i = 0; i < cp; i++)
+    {
+        ctx->pages[i] = NULL;
+        if (first_page + i == page->index)
+        {
+            ctx->pages[i] = page;
+            continue;
+        }
+        if (((loff_t)(first_page + i) << PAGE_SHIFT) >= isize)
+        {
+            continue;
+        }
+        ctx->pages[i] = find_lock_page(inode->i_mapping, first_page + i);
+        if (!ctx->pages[i] || !PageUptodate(ctx->pages[i]))
+        {
+            need_read = true;
+        }
+    }
+
+    if (need_read)
+    {
+        ret = assoofs_read_cluster(inode, first_page / cp, ctx->buf);
+        if (ret)
+        {
+            goto out;
+        }
+    }
+    for (i = 0; i < cp; i++)
+    {
+        if (ctx->pages[i] && PageUptodate(ctx->pages[i]))
+        {
+            memcpy_from_page(ctx->buf + ((size_t)i << PAGE_SHIFT), ctx->pages[i], 0, PAGE_SIZE);
+        }
+    }
+    memset(ctx->buf + len, 0, size - len);
+
+    // Con -o nocompress los clusters se siguen escribiendo enteros, pero sin comprimir
+    nblocks = DIV_ROUND_UP(len, sb->s_blocksize);
+    if (READ_ONCE(sbi->s_compress))
+    {
+        clen = LZ4_compress_default(ctx->buf, ctx->cbuf + sizeof(*ch), len, LZ4_compressBound(size), ctx->wrkmem);
+        if (clen > 0 && DIV_ROUND_UP(sizeof(*ch) + clen, sb->s_blocksize) < nblocks)
+        {
+            plen = DIV_ROUND_UP(sizeof(*ch) + clen, sb->s_blocksize);
+            ch->ch_magic = ASSOOFS_CLUSTER_MAGIC;
+            ch->ch_size = clen;
+            ch->ch_len = len;
+            ch->ch_reserved = 0;
+            memset(ctx->cbuf + sizeof(*ch) + clen, 0, ((size_t)plen << sb->s_blocksize_bits) - sizeof(*ch) - clen);
+        }
+    }
+
+    handle = assoofs_journal_start(sb, assoofs_truncate_credits(sb));
+    // Las páginas sucias del cluster tienen su reserva
+    handle->h_delalloc = true;
+    down_write(ASSOOFS_DATA_SEM(inode));
+    ret = assoofs_remove_extents(sb, inode_info, first, (uint64_t)first + ASSOOFS_CLUSTER_BLOCKS);
+    if (!ret && plen)
+    {
+        ret = assoofs_alloc_cluster(sb, inode_info, first, plen, &pblock);
+        if (!ret)
+        {
+            runs[nruns].pblock = pblock;
+            runs[nruns++].count = plen;
+        }
+        else if (ret == -ENOSPC)
+        {
+            // Sin sitio para los bloques seguidos: se guarda sin comprimir
+            plen = 0;
+            ret = 0;
+        }
+    }
+    for (b = 0; !ret && !plen && b < nblocks; b += count)
+    {
+        ret = assoofs_alloc_blocks(sb, inode_info, first + b, nblocks - b, 0, &pblock, &count);
+        if (!ret)
+        {
+            runs[nruns].pblock = pblock;
+            runs[nruns++].count = count;
+        }
+    }
+    if (!ret)
+    {
+        assoofs_save_inode_info(sb, inode_info);
+    }
+    up_write(ASSOOFS_DATA_SEM(inode));
+    handle->h_delalloc = false;
+    err = assoofs_journal_stop(handle);
+    ret = ret ? ret : err;
+
+    for (i = 0, b = 0; !ret && i < nruns; b += runs[i++].count)
+    {
+        ret = assoofs_cluster_write_blocks(sb, runs[i].pblock, (plen ? ctx->cbuf : ctx->buf) + ((size_t)b << sb->s_blocksize_bits),
+                                           runs[i].count, sync);
+    }
+    if (!ret)
+    {
+        spin_lock(&sbi->s_lock);
+        sbi->s_cluster_bytes += len;
+        sbi->s_cluster_disk_bytes += (uint64_t)(plen ? plen : nblocks) << sb->s_blocksize_bits;
+        if (plen)
+        {
+            sbi->s_clusters_compressed++;
+        }
+        else
+        {
+            sbi->s_clusters_plain++;
+        }
+        spin_unlock(&sbi->s_lock);
+    }
+
+out:
+    for (i = 0; i < cp; i++)
+    {
+        if (!ctx->pages[i])
+        {
+            continue;
+        }
+        // set_page_writeback quita la marca de sucia del índice de la caché
+        if (!ret)
+        {
+            if (ctx->pages[i] != page)
+            {
+                clear_page_dirty_for_io(ctx->pages[i]);
+            }
+            assoofs_page_unreserve(inode, ctx->pages[i]);
+            set_page_writeback(ctx->pages[i]);
+            end_page_writeback(ctx->pages[i]);
+        }
+        unlock_page(ctx->pages[i]);
+        if (ctx->pages[i] != page)
+        {
+            put_page(ctx->pages[i]);
+        }
+    }
+    return ret;
+}
+
+static int assoofs_cluster_writepage(struct page *page, struct writeback_control *wbc, void *data)
+{
+    int ret;
+
+    ret = assoofs_write_cluster(page->mapping->host, page, data, wbc->sync_mode == WB_SYNC_ALL);
+    if (ret)
+    {
+        mapping_set_error(page->mapping, ret);
+    }
+    return ret;
+}
+
+static int assoofs_cluster_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    struct inode *inode = mapping->host;
+    struct assoofs_cluster_ctx ctx;
+    size_t size = assoofs_cluster_bytes(inode);
+    int ret = -ENOMEM;
+
+    ctx.buf = kvmalloc(size, GFP_NOFS);
+    ctx.cbuf = kvmalloc(sizeof(struct assoofs_cluster_header) + LZ4_compressBound(size), GFP_NOFS);
+    ctx.wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_NOFS);
+    ctx.pages = kmalloc_array(assoofs_cluster_pages(inode), sizeof(*ctx.pages), GFP_NOFS);
+    if (ctx.buf && ctx.cbuf && ctx.wrkmem && ctx.pages)
+    {
+        mutex_lock(ASSOOFS_CLUSTER_MUTEX(inode));
+        ret = write_cache_pages(mapping, wbc, assoofs_cluster_writepage, &ctx);
+        mutex_unlock(ASSOOFS_CLUSTER_MUTEX(inode));
+    }
+    kfree(ctx.pages);
+    kvfree(ctx.wrkmem);
+    kvfree(ctx.cbuf);
+    kvfree(ctx.buf);
+    return ret;
+}
+
+static int assoofs_read_folio(struct file *file, struct folio *folio)
+{
+    struct inode *inode = folio->mapping->host;
+
+    if (assoofs_has_inline_data(ASSOOFS_I(inode)))
+    {
+        assoofs_read_inline_folio(inode, folio);
+        folio_unlock(folio);
+        return 0;
+    }
+    if (assoofs_compressed(ASSOOFS_I(inode)))
+    {
+        return assoofs_cluster_read_folio(inode, folio);
+    }
+    return block_read_full_folio(folio, assoofs_get_block);
+}
+
+static void assoofs_readahead(struct readahead_control *rac)
+{
+    // Los datos en línea se leen con read_folio, sin E/S
+    if (assoofs_has_inline_data(ASSOOFS_I(rac->mapping->host)))
+    {
+        return;
+    }
+    if (assoofs_compressed(ASSOOFS_I(rac->mapping->host)))
+    {
+        assoofs_cluster_readahead(rac);
+        return;
+    }
+    mpage_readahead(rac, assoofs_get_block);
+}
+
+/*
+ *  Escritura en extents sin escribir
+ *
+ * Un buffer BH_Unwritten se escribe con assoofs_end_buffer_unwritten como fin
+ * de E/S. Cuando los datos están en el disco, s_unwritten_work convierte su
+ * bloque en una transacción y solo entonces termina la E/S del buffer: hasta
+ * ese momento la página sigue en writeback, así que ni se libera ni se puede
+ * truncar. mpage_writepages no deja poner otro fin de E/S, así que los
+ * ficheros ASSOOFS_INODE_UNWRITTEN se vuelcan página a página.
+ */
+
+// Convierte los bloques de los buffers ya escritos y termina su E/S
+static void assoofs_unwritten_work(struct work_struct *work)
+{
+    struct assoofs_sb_info *sbi = container_of(work, struct assoofs_sb_info, s_unwritten_work);
+    struct super_block *sb = sbi->s_sb;
+    struct assoofs_handle *handle;
+    struct buffer_head *bh, *next;
+    struct inode *inode;
+    sector_t iblock;
+    int ret, err;
+
+    spin_lock_irq(&sbi->s_unwritten_lock);
+    bh = sbi->s_unwritten;
+    sbi->s_unwritten = NULL;
+    spin_unlock_irq(&sbi->s_unwritten_lock);
+
+    for (; bh; bh = next)
+    {
+        next = bh->b_private;
+        bh->b_private = NULL;
+        inode = bh->b_page->mapping->host;
+        iblock = (((loff_t)bh->b_page->index << PAGE_SHIFT) + bh_offset(bh)) >> inode->i_blkbits;
+
+        handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+        down_write(ASSOOFS_DATA_SEM(inode));
+        atomic_dec(&ASSOOFS_INODE(inode)->i_unwritten_io);
+        ret = assoofs_convert_unwritten(sb, ASSOOFS_I(inode), iblock, 1);
+        if (!ret)
+        {
+            assoofs_save_inode_info(sb, ASSOOFS_I(inode));
+        }
+        up_write(ASSOOFS_DATA_SEM(inode));
+        err = assoofs_journal_stop(handle);
+
+        clear_buffer_unwritten(bh);
+        if (ret)
+        {
+            // El bloque sigue sin escribir: se vuelve a leer como ceros y el error llega a fsync
+            printk(KERN_ERR "assoofs: unable to convert block %llu of inode %lu (%d)\n", (unsigned long long)iblock, inode->i_ino, ret);
+            clear_buffer_mapped(bh);
+        }
+        end_buffer_async_write(bh, !ret && !err);
+    }
+}
+
+// Fin de E/S de las páginas de ficheros ASSOOFS_INODE_UNWRITTEN; puede llamarse en contexto de interrupción
+static void assoofs_end_buffer_unwritten(struct buffer_head *bh, int uptodate)
+{
+    struct inode *inode = bh->b_page->mapping->host;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(inode->i_sb);
+    unsigned long flags;
+
+    if (!buffer_unwritten(bh))
+    {
+        end_buffer_async_write(bh, uptodate);
+        return;
+    }
+    if (!uptodate)
+    {
+        // Los datos no han llegado: el bloque sigue sin escribir y se vuelve a leer como ceros
+        clear_buffer_unwritten(bh);
+        clear_buffer_mapped(bh);
+        atomic_dec(&ASSOOFS_INODE(inode)->i_unwritten_io);
+        end_buffer_async_write(bh, 0);
+        return;
+    }
+
+    spin_lock_irqsave(&sbi->s_unwritten_lock, flags);
+    bh->b_private = sbi->s_unwritten;
+    sbi->s_unwritten = bh;
+    spin_unlock_irqrestore(&sbi->s_unwritten_lock, flags);
+    queue_work(sbi->s_unwritten_wq, &sbi->s_unwritten_work);
+}
+
+// Lo mismo que block_write_full_page, pero con assoofs_end_buffer_unwritten como fin de E/S
+static int assoofs_unwritten_writepage(struct page *page, struct writeback_control *wbc, void *data)
+{
+    struct inode *inode = page->mapping->host;
+    loff_t isize = i_size_read(inode);
+    pgoff_t end_index = isize >> PAGE_SHIFT;
+    unsigned int offset = isize & (PAGE_SIZE - 1);
+    int ret;
+
+    if (page->index >= end_index)
+    {
+        if (page->index > end_index || !offset)
+        {
+            unlock_page(page);
+            return 0;
+        }
+        // Lo que hay detrás del final del fichero se escribe como ceros
+        zero_user_segment(page, offset, PAGE_SIZE);
+    }
+    ret = __block_write_full_page(inode, page, assoofs_get_block, wbc, assoofs_end_buffer_unwritten);
+    if (ret)
+    {
+        mapping_set_error(page->mapping, ret);
+    }
+    return ret;
+}
+
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    struct inode *inode = mapping->host;
+    int ret;
+
+    if (assoofs_compressed(ASSOOFS_I(inode)))
+    {
+        return assoofs_cluster_writepages(mapping, wbc);
+    }
+
+    // fallocate no marca el fichero mientras se está volcando con mpage_writepages
+    down_read(&ASSOOFS_INODE(inode)->i_writeback_sem);
+    if (ASSOOFS_I(inode)->flags & ASSOOFS_INODE_UNWRITTEN)
+    {
+        ret = write_cache_pages(mapping, wbc, assoofs_unwritten_writepage, NULL);
+    }
+    else
+    {
+        ret = mpage_writepages(mapping, wbc, assoofs_get_block);
+    }
+    up_read(&ASSOOFS_INODE(inode)->i_writeback_sem);
+    return ret;
+}
+
+/*
+ * Escritura con asignación diferida: si la página no tiene bloques ni buffers
+ * solo se reserva espacio y se copian los datos; los bloques se asignan
+ * cuando mpage_writepages la vuelque. Si ya tiene alguno (o buffers de una
+ * lectura anterior) se escribe sobre ellos como siempre.
+ */
+static int assoofs_da_write_begin(struct inode *inode, struct address_space *mapping, loff_t pos, unsigned len, struct page **pagep)
+{
+    unsigned from = pos & (PAGE_SIZE - 1);
+    unsigned int blocks = assoofs_page_blocks(inode->i_sb);
+    struct page *page;
+    uint64_t pblock;
+    uint32_t count;
+    int ret;
+
+    page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT);
+    if (!page)
+    {
+        return -ENOMEM;
+    }
+
+    down_read(ASSOOFS_DATA_SEM(inode));
+    ret = assoofs_map_block(inode->i_sb, ASSOOFS_I(inode), (uint64_t)page->index * blocks, &pblock, &count, NULL);
+    up_read(ASSOOFS_DATA_SEM(inode));
+    // Solo se difiere una página sin ningún bloque: el hueco tiene que cubrirla entera (count 0 es hasta el final)
+    if (!ret && (pblock || page_has_buffers(page) || (count && count < blocks)))
+    {
+        ret = __block_write_begin(page, pos, len, assoofs_get_block);
+    }
+    else if (!ret)
+    {
+        ret = assoofs_page_reserve(inode, page);
+        // Sin bloque lo que no se escribe son ceros
+        if (!ret && !PageUptodate(page))
+        {
+            zero_user_segments(page, 0, from, from + len, PAGE_SIZE);
+        }
+    }
+    if (ret)
+    {
+        unlock_page(page);
+        put_page(page);
+        return ret;
+    }
+
+    *pagep = page;
+    return 0;
+}
+
+static int assoofs_da_write_end(struct inode *inode, loff_t pos, unsigned len, unsigned copied, struct page *page)
+{
+    unsigned from = pos & (PAGE_SIZE - 1);
+
+    if (!PageUptodate(page))
+    {
+        if (copied < len)
+        {
+            zero_user(page, from + copied, len - copied);
+        }
+        SetPageUptodate(page);
+    }
+    if (copied)
+    {
+        set_page_dirty(page);
+    }
+    if (pos + copied > inode->i_size)
+    {
+        i_size_write(inode, pos + copied);
+    }
+    unlock_page(page);
+    put_page(page);
+    return copied;
+}
+
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, struct page **pagep, void **fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct page *page;
+    int ret;
+
+    if (assoofs_has_inline_data(ASSOOFS_I(inode)))
+    {
+        if (pos + len <= ASSOOFS_INLINE_DATA_MAX)
+        {
+            page = grab_cache_page_write_begin(mapping, 0);
+            if (!page)
+            {
+                return -ENOMEM;
+            }
+            if (assoofs_has_inline_data(ASSOOFS_I(inode)))
+            {
+                if (!PageUptodate(page))
+                {
+                    assoofs_read_inline_folio(inode, page_folio(page));
+                }
+                *pagep = page;
+                return 0;
+            }
+            // Convertido mientras se esperaba la página: se sigue por bloques
+            unlock_page(page);
+            put_page(page);
+        }
+        else
+        {
+            ret = assoofs_inline_convert(inode);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+    }
+    if (assoofs_compressed(ASSOOFS_I(inode)))
+    {
+        return assoofs_cluster_write_begin(inode, mapping, pos, len, pagep);
+    }
+    return assoofs_da_write_begin(inode, mapping, pos, len, pagep);
+}
+
+static int assoofs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    int ret;
+
+    // Con la página 0 bloqueada desde write_begin la marca no ha podido cambiar
+    if (assoofs_has_inline_data(inode_info))
+    {
+        return assoofs_write_inline_end(inode, pos, copied, page);
+    }
+
+    // Las páginas diferidas y las de los ficheros comprimidos son las únicas que llegan aquí sin buffers
+    if (page_has_buffers(page))
+    {
+        ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    }
+    else
+    {
+        ret = assoofs_da_write_end(inode, pos, len, copied, page);
+    }
+
+    // El tamaño del fichero se guarda en el almacén de inodos cuando crece
+    // (en modo asíncrono queda en la transacción hasta el siguiente commit)
+    if (i_size_read(inode) > inode_info->file_size)
+    {
+        handle = assoofs_journal_start(inode->i_sb, ASSOOFS_JOURNAL_CREDITS);
+        down_write(ASSOOFS_DATA_SEM(inode));
+        inode_info->file_size = i_size_read(inode);
+        assoofs_save_inode_info(inode->i_sb, inode_info);
+        up_write(ASSOOFS_DATA_SEM(inode));
+        assoofs_journal_stop(handle);
+    }
+    return ret;
+}
+
+// Una página diferida que desaparece entera sin haberse volcado devuelve su reserva
+static void assoofs_invalidate_folio(struct folio *folio, size_t offset, size_t length)
+{
+    struct inode *inode = folio->mapping->host;
+    struct buffer_head *head = folio_buffers(folio);
+    struct buffer_head *bh = head;
+    size_t start = 0;
+
+    if (offset == 0 && length == folio_size(folio))
+    {
+        assoofs_page_unreserve(inode, &folio->page);
+    }
+    // block_invalidate_folio quita BH_Unwritten a los buffers que descarta sin que lleguen a escribirse
+    while (bh)
+    {
+        if (start >= offset && start + bh->b_size <= offset + length && buffer_unwritten(bh))
+        {
+            atomic_dec(&ASSOOFS_INODE(inode)->i_unwritten_io);
+        }
+        start += bh->b_size;
+        bh = bh->b_this_page == head ? NULL : bh->b_this_page;
+    }
+    block_invalidate_folio(folio, offset, length);
+}
+
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block)
+{
+    // Los bloques de un cluster comprimido no tienen un bloque físico propio
+    if (assoofs_compressed(ASSOOFS_I(mapping->host)))
+    {
+        return 0;
+    }
+    return generic_block_bmap(mapping, block, assoofs_get_block);
+}
+
+static const struct address_space_operations assoofs_aops = {
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = assoofs_invalidate_folio,
+    .read_folio = assoofs_read_folio,
+    .readahead = assoofs_readahead,
+    .writepages = assoofs_writepages,
+    .write_begin = assoofs_write_begin,
+    .write_end = assoofs_write_end,
+    .bmap = assoofs_bmap,
+    .direct_IO = noop_direct_IO,  /* O_DIRECT va por iomap en read_iter/write_iter */
+    .migrate_folio = buffer_migrate_folio,
+    .error_remove_page = generic_error_remove_page,
+};
+
+/*
+ *  E/S directa (O_DIRECT)
+ *
+ * iomap_dio_rw pide con assoofs_iomap_begin el tramo de disco que corresponde
+ * a cada parte de la petición y lleva los datos directamente entre el buffer
+ * de usuario y el dispositivo, sin pasar por la caché de páginas.
+ */
+
+/*
+ * Devuelve el extent que cubre pos hasta como mucho pos + length. En
+ * escrituras los huecos se reservan aquí, tantos bloques contiguos como se
+ * pueda de una vez.
+ */
+static int assoofs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned int flags, struct iomap *iomap, struct iomap *srcmap)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    uint64_t first = pos >> sb->s_blocksize_bits;
+    uint64_t last = (pos + length - 1) >> sb->s_blocksize_bits;
+    uint64_t pblock;
+    uint32_t wanted;
+    uint32_t count;
+    bool unwritten;
+    bool new = false;
+    int ret, err;
+
+    if (last > U32_MAX)
+    {
+        return -EFBIG;
+    }
+    // De 0 a U32_MAX son 2^32 bloques, que no caben en 32 bits; iomap vuelve a pedir lo que falte
+    wanted = min_t(uint64_t, last - first + 1, U32_MAX);
+
+    down_read(ASSOOFS_DATA_SEM(inode));
+    ret = assoofs_map_block(sb, inode_info, first, &pblock, &count, &unwritten);
+    up_read(ASSOOFS_DATA_SEM(inode));
+    if (ret)
+    {
+        return ret;
+    }
+
+    if (!pblock && (flags & IOMAP_WRITE))
+    {
+        handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+        down_write(ASSOOFS_DATA_SEM(inode));
+        ret = assoofs_map_block(sb, inode_info, first, &pblock, &count, &unwritten);
+        if (!ret && !pblock)
+        {
+            // Como mucho un bloque de mapa de bits por transacción
+            ret = assoofs_alloc_blocks(sb, inode_info, first, min_t(uint32_t, wanted, ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize)), 0, &pblock, &count);
+            if (!ret)
+            {
+                assoofs_save_inode_info(sb, inode_info);
+                new = true;
+            }
+        }
+        up_write(ASSOOFS_DATA_SEM(inode));
+        err = assoofs_journal_stop(handle);
+        ret = ret ? ret : err;
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    if (count)
+    {
+        wanted = min(wanted, count);
+    }
+    iomap->bdev = sb->s_bdev;
+    iomap->offset = first << sb->s_blocksize_bits;
+    iomap->length = (u64)wanted << sb->s_blocksize_bits;
+    if (pblock)
+    {
+        // Sin escribir: iomap lee ceros y, al escribir, avisa en end_io para convertirlo
+        iomap->type = unwritten ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+        iomap->addr = pblock << sb->s_blocksize_bits;
+    }
+    else if (flags & IOMAP_REPORT)
+    {
+        // Para SEEK_DATA/SEEK_HOLE: un hueco puede tener páginas diferidas con datos, que iomap busca en la caché
+        iomap->type = IOMAP_UNWRITTEN;
+        iomap->addr = IOMAP_NULL_ADDR;
+    }
+    else
+    {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+    }
+    if (new)
+    {
+        // Bloques nuevos: iomap pone a cero lo que no cubre la escritura y O_DSYNC tiene que confirmar el diario
+        iomap->flags |= IOMAP_F_NEW | IOMAP_F_DIRTY;
+    }
+    return 0;
+}
+
+static const struct iomap_ops assoofs_iomap_ops = {
+    .iomap_begin = assoofs_iomap_begin,
+};
+
+/*
+ * Al terminar una escritura directa los extents sin escribir que ha cubierto
+ * pasan a escritos y, si pasa del final del fichero, se guarda el tamaño
+ * nuevo.
+ */
+static int assoofs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned int flags)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    loff_t end = iocb->ki_pos + size;
+    int ret = 0;
+    int err;
+
+    if (error || !size || (!(flags & IOMAP_DIO_UNWRITTEN) && end <= i_size_read(inode)))
+    {
+        return error;
+    }
+
+    handle = assoofs_journal_start(sb, assoofs_truncate_credits(sb));
+    down_write(ASSOOFS_DATA_SEM(inode));
+    if (flags & IOMAP_DIO_UNWRITTEN)
+    {
+        ret = assoofs_convert_unwritten(sb, inode_info, iocb->ki_pos >> sb->s_blocksize_bits,
+                                        ((end - 1) >> sb->s_blocksize_bits) - (iocb->ki_pos >> sb->s_blocksize_bits) + 1);
+    }
+    if (end > i_size_read(inode))
+    {
+        i_size_write(inode, end);
+        inode_info->file_size = end;
+    }
+    assoofs_save_inode_info(sb, inode_info);
+    up_write(ASSOOFS_DATA_SEM(inode));
+    mark_inode_dirty(inode);
+    err = assoofs_journal_stop(handle);
+    return ret ? ret : err;
+}
+
+static const struct iomap_dio_ops assoofs_dio_write_ops = {
+    .end_io = assoofs_dio_write_end_io,
+};
+
+/*
+ * SEEK_HOLE y SEEK_DATA recorren los extents con assoofs_iomap_begin: los
+ * huecos y los extents sin escribir solo cuentan como datos donde haya
+ * páginas en la caché. Un fichero en línea es todo datos hasta el final.
+ */
+static loff_t assoofs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct inode *inode = file_inode(file);
+
+    if ((whence != SEEK_HOLE && whence != SEEK_DATA) || assoofs_has_inline_data(ASSOOFS_I(inode)))
+    {
+        return generic_file_llseek(file, offset, whence);
+    }
+
+    inode_lock_shared(inode);
+    if (whence == SEEK_HOLE)
+    {
+        offset = iomap_seek_hole(inode, offset, &assoofs_iomap_ops);
+    }
+    else
+    {
+        offset = iomap_seek_data(inode, offset, &assoofs_iomap_ops);
+    }
+    inode_unlock_shared(inode);
+    if (offset < 0)
+    {
+        return offset;
+    }
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+static ssize_t assoofs_do_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+    {
+        return generic_file_read_iter(iocb, to);
+    }
+    // Ni los datos en línea ni los clusters comprimidos tienen bloques a los que ir directamente: van por la caché de páginas
+    if (assoofs_has_inline_data(ASSOOFS_I(inode)) || assoofs_compressed(ASSOOFS_I(inode)))
+    {
+        iocb->ki_flags &= ~IOCB_DIRECT;
+        return generic_file_read_iter(iocb, to);
+    }
+    if (!iov_iter_count(to))
+    {
+        return 0;
+    }
+
+    inode_lock_shared(inode);
+    ret = iomap_dio_rw(iocb, to, &assoofs_iomap_ops, NULL, 0, NULL, 0);
+    inode_unlock_shared(inode);
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+static ssize_t assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = assoofs_do_read_iter(iocb, to);
+    assoofs_op_done(inode->i_sb, ASSOOFS_OP_READ, inode->i_ino, pos, count, ret, start);
+    return ret;
+}
+
+static ssize_t assoofs_do_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+    {
+        return generic_file_write_iter(iocb, from);
+    }
+    if (assoofs_has_inline_data(ASSOOFS_I(inode)) || assoofs_compressed(ASSOOFS_I(inode)))
+    {
+        iocb->ki_flags &= ~IOCB_DIRECT;
+        return generic_file_write_iter(iocb, from);
+    }
+
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret > 0)
+    {
+        ret = file_modified(iocb->ki_filp);
+        if (!ret)
+        {
+            // iomap escribe y descarta antes lo que hubiera en la caché de páginas de ese rango
+            ret = iomap_dio_rw(iocb, from, &assoofs_iomap_ops, &assoofs_dio_write_ops, 0, NULL, 0);
+        }
+    }
+    inode_unlock(inode);
+
+    // Con O_SYNC/O_DSYNC iomap_dio_rw ya ha llamado a generic_write_sync
+    return ret;
+}
+
+static ssize_t assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = assoofs_do_write_iter(iocb, from);
+    // Con O_APPEND la posición real la decide generic_write_checks: se toma la final menos lo escrito
+    assoofs_op_done(inode->i_sb, ASSOOFS_OP_WRITE, inode->i_ino, ret > 0 ? iocb->ki_pos - ret : pos, count, ret, start);
+    return ret;
+}
+
+/*
+ * Una página de un fichero en línea no puede ensuciarse: antes de escribir en
+ * ella por mmap se pasa a bloques. Como en write_begin, una página sin ningún
+ * bloque (o de un fichero comprimido) queda diferida con su reserva y a una
+ * con huecos se le asignan ya, para que el volcado no se quede sin sitio.
+ */
+static vm_fault_t assoofs_page_mkwrite(struct vm_fault *vmf)
+{
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    unsigned int blocks = assoofs_page_blocks(inode->i_sb);
+    struct page *page = vmf->page;
+    loff_t size;
+    uint64_t pblock;
+    uint32_t count;
+    unsigned len;
+    int ret = 0;
+
+    if (assoofs_has_inline_data(inode_info) && assoofs_inline_convert(inode))
+    {
+        return VM_FAULT_SIGBUS;
+    }
+
+    sb_start_pagefault(inode->i_sb);
+    lock_page(page);
+    size = i_size_read(inode);
+    // Truncada mientras tanto: filemap_page_mkwrite se encarga
+    if (page->mapping == inode->i_mapping && page_offset(page) < size)
+    {
+        len = min_t(loff_t, PAGE_SIZE, size - page_offset(page));
+        if (assoofs_compressed(inode_info))
+        {
+            ret = assoofs_page_reserve(inode, page);
+        }
+        else
+        {
+            down_read(ASSOOFS_DATA_SEM(inode));
+            ret = assoofs_map_block(inode->i_sb, inode_info, (uint64_t)page->index * blocks, &pblock, &count, NULL);
+            up_read(ASSOOFS_DATA_SEM(inode));
+            if (!ret && !pblock && !page_has_buffers(page) && !(count && count < blocks))
+            {
+                ret = assoofs_page_reserve(inode, page);
+            }
+            else if (!ret && (!pblock || (count && count < blocks)))
+            {
+                ret = __block_write_begin(page, 0, len, assoofs_get_block);
+                if (!ret)
+                {
+                    block_commit_write(page, 0, len);
+                }
+            }
+        }
+    }
+    unlock_page(page);
+    sb_end_pagefault(inode->i_sb);
+    if (ret)
+    {
+        return vmf_error(ret);
+    }
+    return filemap_page_mkwrite(vmf);
+}
+
+static const struct vm_operations_struct assoofs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = assoofs_page_mkwrite,
+};
+
+static int assoofs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    file_accessed(file);
+    vma->vm_ops = &assoofs_file_vm_ops;
+    return 0;
+}
+
+/*
+ * Lo que queda en disco detrás del nuevo final en el último cluster no puede
+ * volver a aparecer si el fichero crece: la página del final (con la cola ya
+ * a cero en la caché) se ensucia para que el cluster se vuelva a escribir.
+ */
+static int assoofs_cluster_truncate(struct inode *inode, loff_t size)
+{
+    struct page *page;
+
+    page = read_mapping_page(inode->i_mapping, (size - 1) >> PAGE_SHIFT, NULL);
+    if (IS_ERR(page))
+    {
+        return PTR_ERR(page);
+    }
+    lock_page(page);
+    if (page->mapping == inode->i_mapping)
+    {
+        set_page_dirty(page);
+    }
+    unlock_page(page);
+    put_page(page);
+    return 0;
+}
+
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *iattr)
+{
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    int ret, err;
+
+    ret = setattr_prepare(mnt_userns, dentry, iattr);
+    if (ret)
+    {
+        return ret;
+    }
+
+    if ((iattr->ia_valid & ATTR_SIZE) && iattr->ia_size != i_size_read(inode))
+    {
+        bool shrink = iattr->ia_size < i_size_read(inode);
+
+        // Las escrituras directas asíncronas en curso pueden estar usando los bloques que se liberan
+        inode_dio_wait(inode);
+        if (assoofs_has_inline_data(inode_info) && iattr->ia_size > ASSOOFS_INLINE_DATA_MAX)
+        {
+            ret = assoofs_inline_convert(inode);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        if (shrink && !assoofs_has_inline_data(inode_info) && !assoofs_compressed(inode_info))
+        {
+            // Se pone a cero el final del último bloque que se conserva
+            ret = block_truncate_page(inode->i_mapping, iattr->ia_size, assoofs_get_block);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        truncate_setsize(inode, iattr->ia_size);
+
+        handle = assoofs_journal_start(inode->i_sb, assoofs_truncate_credits(inode->i_sb));
+        down_write(ASSOOFS_DATA_SEM(inode));
+        if (assoofs_has_inline_data(inode_info))
+        {
+            // Lo que queda detrás del final tiene que leerse como ceros si el fichero vuelve a crecer
+            memset(inode_info->inline_data + iattr->ia_size, 0, ASSOOFS_INLINE_DATA_MAX - iattr->ia_size);
+        }
+        else if (assoofs_compressed(inode_info))
+        {
+            // Los clusters no se parten: se conserva entero el que contiene el nuevo final
+            ret = assoofs_truncate_extents(inode->i_sb, inode_info,
+                                           DIV_ROUND_UP(iattr->ia_size, assoofs_cluster_bytes(inode)) * ASSOOFS_CLUSTER_BLOCKS);
+        }
+        else
+        {
+            ret = assoofs_truncate_extents(inode->i_sb, inode_info, DIV_ROUND_UP(iattr->ia_size, inode->i_sb->s_blocksize));
+        }
+        inode_info->file_size = iattr->ia_size;
+        assoofs_save_inode_info(inode->i_sb, inode_info);
+        up_write(ASSOOFS_DATA_SEM(inode));
+        err = assoofs_journal_stop(handle);
+        ret = ret ? ret : err;
+        if (!ret && shrink && assoofs_compressed(inode_info) && !assoofs_has_inline_data(inode_info) && iattr->ia_size % assoofs_cluster_bytes(inode))
+        {
+            ret = assoofs_cluster_truncate(inode, iattr->ia_size);
+        }
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    setattr_copy(mnt_userns, inode, iattr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ *  fallocate: reserva por adelantado (con o sin FALLOC_FL_KEEP_SIZE) y
+ *  FALLOC_FL_PUNCH_HOLE
+ */
+
+// Pone a cero len bytes a partir de pos, dentro de un mismo bloque; la página queda sucia para llevarlo al disco
+static int assoofs_zero_partial_block(struct inode *inode, loff_t pos, unsigned int len)
+{
+    struct page *page;
+    uint64_t pblock;
+    uint32_t count;
+    bool unwritten;
+    int ret;
+
+    down_read(ASSOOFS_DATA_SEM(inode));
+    ret = assoofs_map_block(inode->i_sb, ASSOOFS_I(inode), pos >> inode->i_blkbits, &pblock, &count, &unwritten);
+    up_read(ASSOOFS_DATA_SEM(inode));
+    // En un hueco o un bloque sin escribir el disco ya se lee como ceros; la caché la limpia truncate_pagecache_range
+    if (ret || !pblock || unwritten)
+    {
+        return ret;
+    }
+
+    page = read_mapping_page(inode->i_mapping, pos >> PAGE_SHIFT, NULL);
+    if (IS_ERR(page))
+    {
+        return PTR_ERR(page);
+    }
+    lock_page(page);
+    zero_user(page, offset_in_page(pos), len);
+    set_page_dirty(page);
+    unlock_page(page);
+    put_page(page);
+    return 0;
+}
+
+static int assoofs_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    loff_t end = min_t(loff_t, offset + len, sb->s_maxbytes);
+    loff_t first = round_up(offset, sb->s_blocksize);
+    loff_t last = round_down(end, sb->s_blocksize);
+    int ret = 0, err;
+
+    if (offset >= end)
+    {
+        return 0;
+    }
+
+    if (assoofs_has_inline_data(inode_info))
+    {
+        if (offset < ASSOOFS_INLINE_DATA_MAX)
+        {
+            handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+            down_write(ASSOOFS_DATA_SEM(inode));
+            memset(inode_info->inline_data + offset, 0, min_t(loff_t, end, ASSOOFS_INLINE_DATA_MAX) - offset);
+            ret = assoofs_save_inode_info(sb, inode_info);
+            up_write(ASSOOFS_DATA_SEM(inode));
+            err = assoofs_journal_stop(handle);
+            ret = ret ? ret : err;
+        }
+        truncate_pagecache_range(inode, offset, end - 1);
+        return ret;
+    }
+
+    // Los trozos de bloque de los extremos se ponen a cero; los bloques enteros se liberan
+    if (first > last)
+    {
+        ret = assoofs_zero_partial_block(inode, offset, end - offset);
+    }
+    else
+    {
+        if (offset < first)
+        {
+            ret = assoofs_zero_partial_block(inode, offset, first - offset);
+        }
+        if (!ret && last < end)
+        {
+            ret = assoofs_zero_partial_block(inode, last, end - last);
+        }
+    }
+    if (ret)
+    {
+        return ret;
+    }
+    truncate_pagecache_range(inode, offset, end - 1);
+
+    if (first < last)
+    {
+        handle = assoofs_journal_start(sb, assoofs_truncate_credits(sb));
+        down_write(ASSOOFS_DATA_SEM(inode));
+        ret = assoofs_remove_extents(sb, inode_info, first >> sb->s_blocksize_bits, last >> sb->s_blocksize_bits);
+        if (!ret)
+        {
+            ret = assoofs_save_inode_info(sb, inode_info);
+        }
+        up_write(ASSOOFS_DATA_SEM(inode));
+        err = assoofs_journal_stop(handle);
+        ret = ret ? ret : err;
+    }
+    return ret;
+}
+
+/*
+ * Reserva los bloques que falten en el rango como extents sin escribir, en
+ * tramos contiguos tan largos como se pueda. Lo que ya está asignado se deja
+ * como está.
+ */
+static int assoofs_prealloc(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    uint64_t iblock = offset >> sb->s_blocksize_bits;
+    uint64_t last = (offset + len - 1) >> sb->s_blocksize_bits;
+    uint64_t pblock;
+    uint32_t count;
+    uint32_t wanted;
+    int ret = 0, err;
+
+    if (last > U32_MAX)
+    {
+        return -EFBIG;
+    }
+
+    if (assoofs_has_inline_data(inode_info) && offset + len > ASSOOFS_INLINE_DATA_MAX)
+    {
+        ret = assoofs_inline_convert(inode);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    // Antes del primer extent sin escribir: a partir de aquí sus páginas se vuelcan con assoofs_unwritten_writepage
+    if (!assoofs_has_inline_data(inode_info) && !(inode_info->flags & ASSOOFS_INODE_UNWRITTEN))
+    {
+        down_write(&ASSOOFS_INODE(inode)->i_writeback_sem);
+        down_write(ASSOOFS_DATA_SEM(inode));
+        inode_info->flags |= ASSOOFS_INODE_UNWRITTEN;
+        up_write(ASSOOFS_DATA_SEM(inode));
+        up_write(&ASSOOFS_INODE(inode)->i_writeback_sem);
+    }
+
+    // Un fichero que sigue en línea ya tiene sitio para todo el rango
+    while (!assoofs_has_inline_data(inode_info) && iblock <= last)
+    {
+        handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+        down_write(ASSOOFS_DATA_SEM(inode));
+        ret = assoofs_map_block(sb, inode_info, iblock, &pblock, &count, NULL);
+        if (!ret && !pblock)
+        {
+            // Como mucho un bloque de mapa de bits por transacción
+            wanted = min_t(uint64_t, last - iblock + 1, ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize));
+            ret = assoofs_alloc_blocks(sb, inode_info, iblock, wanted, ASSOOFS_EXT_UNWRITTEN, &pblock, &count);
+            if (!ret)
+            {
+                ret = assoofs_save_inode_info(sb, inode_info);
+            }
+        }
+        up_write(ASSOOFS_DATA_SEM(inode));
+        err = assoofs_journal_stop(handle);
+        ret = ret ? ret : err;
+        if (ret)
+        {
+            return ret;
+        }
+        iblock += count;
+    }
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > i_size_read(inode))
+    {
+        handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+        down_write(ASSOOFS_DATA_SEM(inode));
+        i_size_write(inode, offset + len);
+        inode_info->file_size = offset + len;
+        ret = assoofs_save_inode_info(sb, inode_info);
+        up_write(ASSOOFS_DATA_SEM(inode));
+        err = assoofs_journal_stop(handle);
+        ret = ret ? ret : err;
+    }
+    return ret;
+}
+
+static long assoofs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    int ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+    {
+        return -EOPNOTSUPP;
+    }
+    // Los bloques de un fichero comprimido se rehacen por clusters enteros al volcarlos
+    if (assoofs_compressed(ASSOOFS_I(inode)))
+    {
+        return -EOPNOTSUPP;
+    }
+
+    inode_lock(inode);
+    // Igual que al truncar: no puede haber escrituras directas usando los bloques que se liberan
+    inode_dio_wait(inode);
+    ret = file_modified(file);
+    if (!ret)
+    {
+        if (mode & FALLOC_FL_PUNCH_HOLE)
+        {
+            ret = assoofs_punch_hole(inode, offset, len);
+        }
+        else
+        {
+            ret = assoofs_prealloc(inode, mode, offset, len);
+        }
+    }
+    inode_unlock(inode);
+    return ret;
+}
+
+/*
+ *  Entradas de directorio e índice hash
+ */
+
+// Hash FNV-1a del nombre: tiene que ser estable entre montajes porque se guarda en disco
+static uint32_t assoofs_dir_hash(const char *name, unsigned int len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len--)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int assoofs_cmp_hash(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Registro siguiente a de (el primero si de es NULL), libre o no; NULL al final del bloque o si está corrupto
+static struct assoofs_dir_record_entry *assoofs_dir_next_rec(struct super_block *sb, void *block, struct assoofs_dir_record_entry *de)
+{
+    unsigned int end = ASSOOFS_DIR_BLOCK_DATA(sb->s_blocksize);
+    unsigned int off = de ? (char *)de - (char *)block + de->rec_len : 0;
+
+    if (off >= end)
+    {
+        return NULL;
+    }
+
+    de = block + off;
+    if (off + sizeof(*de) > end || de->rec_len < ASSOOFS_DIR_REC_LEN(0) || (de->rec_len & 3) ||
+        off + de->rec_len > end || (de->inode_no && ASSOOFS_DIR_REC_LEN(de->name_len) > de->rec_len))
+    {
+        printk(KERN_ERR "assoofs: corrupted directory entry at offset %u\n", off);
+        return NULL;
+    }
+    return de;
+}
+
+// Siguiente entrada en uso del bloque a partir de de (la primera si de es NULL)
+static struct assoofs_dir_record_entry *assoofs_dir_next_entry(struct super_block *sb, void *block, struct assoofs_dir_record_entry *de)
+{
+    while ((de = assoofs_dir_next_rec(sb, block, de)))
+    {
+        if (de->inode_no)
+        {
+            return de;
+        }
+    }
+    return NULL;
+}
+
+// Bloque de directorio vacío: un único registro libre que lo ocupa entero hasta la cola
+static void assoofs_dir_init_block(struct super_block *sb, void *block)
+{
+    struct assoofs_dir_record_entry *de = block;
+
+    memset(block, 0, ASSOOFS_DIR_BLOCK_DATA(sb->s_blocksize));
+    de->rec_len = ASSOOFS_DIR_BLOCK_DATA(sb->s_blocksize);
+    assoofs_dir_tail(sb, block)->dt_free = ASSOOFS_DIR_BLOCK_DATA(sb->s_blocksize);
+}
 
-int assoofs_sb_set_a_freeblock(struct super_block *sb, uint64_t block);
-int assoofs_sb_get_a_freeinode(struct super_block *sb, unsigned long *inode);
-static int assoofs_remove(struct inode *dir, struct dentry *dentry);
-int assoofs_sb_set_a_freeinode(struct super_block *sb, unsigned long inode_no);
-static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
-static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
-int assoofs_destroy_inode(struct inode *inode);
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
-ssize_t assoofs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos);
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
-void assoofs_save_sb_info(struct super_block *vsb);
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
+// Lo que ocuparían las entradas del bloque compactadas, sin tocarlo; -EIO si la cadena de registros está rota
+static int assoofs_dir_used(struct super_block *sb, void *block)
+{
+    struct assoofs_dir_record_entry *de = NULL;
+    unsigned int off = 0;
+    unsigned int used = 0;
 
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
+    while ((de = assoofs_dir_next_rec(sb, block, de)))
+    {
+        off = (char *)de - (char *)block + de->rec_len;
+        used += de->inode_no ? ASSOOFS_DIR_REC_LEN(de->name_len) : 0;
+    }
+    return off == ASSOOFS_DIR_BLOCK_DATA(sb->s_blocksize) ? used : -EIO;
+}
 
-static int assoofs_remove(struct inode *dir, struct dentry *dentry){
-    struct super_block *sb;
-    struct inode *inode_remove;
-    struct assoofs_inode_info *inode_info_remove;
-    struct assoofs_inode_info *parent_inode_info;
+/*
+ * Junta al principio del bloque las entradas en uso, cada una en un registro
+ * justo para su nombre, y deja todo el sitio libre detrás de la última (en su
+ * registro). Devuelve lo que ocupan las entradas (y en *last la última, NULL
+ * si no hay ninguna) o -EIO si la cadena de registros está rota, sin tocarlo.
+ * Cambia el bloque: solo se llama cuando se va a escribir después.
+ */
+static int assoofs_dir_compact_block(struct super_block *sb, void *block, struct assoofs_dir_record_entry **last)
+{
+    struct assoofs_dir_record_entry *de;
+    struct assoofs_dir_record_entry *next;
+    unsigned int end = ASSOOFS_DIR_BLOCK_DATA(sb->s_blocksize);
+    unsigned int off;
+    unsigned int len;
+
+    if (assoofs_dir_used(sb, block) < 0)
+    {
+        return -EIO;
+    }
+
+    // Cada entrada va a parar a off <= su sitio, antes del registro siguiente, que ya se ha leído
+    *last = NULL;
+    off = 0;
+    next = assoofs_dir_next_rec(sb, block, NULL);
+    while ((de = next))
+    {
+        next = assoofs_dir_next_rec(sb, block, de);
+        if (!de->inode_no)
+        {
+            continue;
+        }
+        len = ASSOOFS_DIR_REC_LEN(de->name_len);
+        memmove(block + off, de, len);
+        *last = block + off;
+        (*last)->rec_len = len;
+        off += len;
+    }
+
+    if (!*last)
+    {
+        assoofs_dir_init_block(sb, block);
+        return 0;
+    }
+    (*last)->rec_len += end - off;
+    memset(block + off, 0, end - off);
+    assoofs_dir_tail(sb, block)->dt_free = end - off;
+    return off;
+}
+
+static struct assoofs_dir_record_entry *assoofs_dir_find_entry(struct super_block *sb, void *block, const struct qstr *name)
+{
+    struct assoofs_dir_record_entry *de = NULL;
+
+    while ((de = assoofs_dir_next_entry(sb, block, de)))
+    {
+        if (de->name_len == name->len && !memcmp(de->filename, name->name, name->len))
+        {
+            return de;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Guarda la entrada en el primer registro con sitio: uno libre o el hueco
+ * que deja al final un registro en uso, que se parte en dos. Las entradas que
+ * ya están no se mueven: si el sitio libre está repartido en huecos pequeños
+ * devuelve -ENOSPC y el bloque se parte; solo ASSOOFS_IOC_COMPACT_DIR junta
+ * los huecos. Si devuelve error el bloque queda como estaba.
+ */
+static int assoofs_dir_insert_entry(struct super_block *sb, void *block, const char *name, unsigned int len, uint64_t inode_no, uint8_t file_type)
+{
+    struct assoofs_dir_record_entry *de = NULL;
+    struct assoofs_dir_record_entry *new_de;
+    struct assoofs_dir_tail *tail = assoofs_dir_tail(sb, block);
+    unsigned int need = ASSOOFS_DIR_REC_LEN(len);
+    unsigned int used;
+
+    // dt_free dice sin recorrer el bloque si no cabe
+    if (tail->dt_free < need)
+    {
+        return -ENOSPC;
+    }
+
+    while ((de = assoofs_dir_next_rec(sb, block, de)))
+    {
+        used = de->inode_no ? ASSOOFS_DIR_REC_LEN(de->name_len) : 0;
+        if (de->rec_len - used < need)
+        {
+            continue;
+        }
+
+        if (used)
+        {
+            new_de = (void *)de + used;
+            new_de->rec_len = de->rec_len - used;
+            de->rec_len = used;
+            de = new_de;
+        }
+        de->inode_no = inode_no;
+        de->name_len = len;
+        de->file_type = file_type;
+        memcpy(de->filename, name, len);
+        tail->dt_free -= need;
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+// El registro borrado se suma al anterior; si es el primero del bloque solo se marca libre
+static void assoofs_dir_delete_entry(struct super_block *sb, void *block, struct assoofs_dir_record_entry *de)
+{
+    struct assoofs_dir_record_entry *prev = NULL;
+    struct assoofs_dir_record_entry *cur = NULL;
+
+    assoofs_dir_tail(sb, block)->dt_free += ASSOOFS_DIR_REC_LEN(de->name_len);
+    while ((cur = assoofs_dir_next_rec(sb, block, cur)) && cur != de)
+    {
+        prev = cur;
+    }
+
+    if (cur == de && prev)
+    {
+        prev->rec_len += de->rec_len;
+    }
+    else
+    {
+        de->inode_no = 0;
+    }
+}
+
+/*
+ * Posiciones de readdir: no dependen de dónde esté guardada cada entrada
+ * (que cambia al partir, juntar o convertir bloques) sino de su hash, como en
+ * ext4. La posición de un nombre es la mitad de su hash para que quepa en el
+ * off_t de 32 bits de las llamadas compat; ASSOOFS_DIR_EOF es el final.
+ */
+#define ASSOOFS_DIR_EOF 0x7fffffff
+
+static uint32_t assoofs_dir_hash2pos(uint32_t hash)
+{
+    return min_t(uint32_t, hash >> 1, ASSOOFS_DIR_EOF - 1);
+}
+
+// Entrada de un bloque pendiente de emitir: su posición de readdir y dónde está en el bloque
+struct assoofs_dir_pos {
+    uint32_t pos;
+    uint32_t off;
+};
+
+#define ASSOOFS_DIR_POS_MAX(bs) (ASSOOFS_DIR_BLOCK_DATA(bs) / ASSOOFS_DIR_REC_LEN(0))
+
+static int assoofs_cmp_dir_pos(const void *a, const void *b)
+{
+    const struct assoofs_dir_pos *x = a, *y = b;
+
+    if (x->pos != y->pos)
+    {
+        return x->pos < y->pos ? -1 : 1;
+    }
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/*
+ * Emite en orden de posición las entradas del bloque a partir de ctx->pos;
+ * false si el buffer de usuario se llena. ctx->pos queda en la posición de la
+ * entrada que no ha cabido, así que los nombres que comparten posición se
+ * vuelven a dar todos en la siguiente llamada. ents tiene sitio para
+ * ASSOOFS_DIR_POS_MAX entradas.
+ */
+static bool assoofs_dir_emit_block(struct super_block *sb, struct dir_context *ctx, void *block, struct assoofs_dir_pos *ents)
+{
+    struct assoofs_dir_record_entry *de = NULL;
+    unsigned int n = 0;
+    unsigned int i;
+    uint32_t pos;
+
+    while ((de = assoofs_dir_next_entry(sb, block, de)))
+    {
+        pos = assoofs_dir_hash2pos(assoofs_dir_hash(de->filename, de->name_len));
+        if (pos >= ctx->pos)
+        {
+            ents[n].pos = pos;
+            ents[n++].off = (char *)de - (char *)block;
+        }
+    }
+    sort(ents, n, sizeof(*ents), assoofs_cmp_dir_pos, NULL);
+
+    for (i = 0; i < n; i++)
+    {
+        de = block + ents[i].off;
+        ctx->pos = ents[i].pos;
+        if (!dir_emit(ctx, de->filename, de->name_len, de->inode_no, fs_ftype_to_dtype(de->file_type)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Pone al día la suma del bloque de directorio modificado y lo añade a la transacción
+static void assoofs_dir_dirty(struct super_block *sb, struct assoofs_inode_info *dir_info, struct buffer_head *bh)
+{
+    assoofs_dir_tail(sb, bh->b_data)->dt_checksum = assoofs_dir_csum(sb, dir_info->inode_no, bh->b_data);
+    set_buffer_assoofs_verified(bh);
+    assoofs_journal_dirty(sb, bh);
+}
+
+// Lee el bloque lógico lblk del directorio; NULL si no está asignado, falla la lectura o no cuadra su suma
+static struct buffer_head *assoofs_dir_bread(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t lblk)
+{
     struct buffer_head *bh;
-    struct assoofs_dir_record_entry *dir_contents;
+    uint64_t pblock;
+    uint32_t count;
+
+    if (assoofs_map_block(sb, dir_info, lblk, &pblock, &count, NULL) || !pblock)
+    {
+        printk(KERN_ERR "assoofs: directory %llu has no block %u\n", dir_info->inode_no, lblk);
+        return NULL;
+    }
+    bh = assoofs_bread(sb, pblock);
+    if (!bh || buffer_assoofs_verified(bh))
+    {
+        return bh;
+    }
+
+    // Lectores con i_data_sem compartido pueden llegar a la vez: la comprobación va con el buffer bloqueado
+    lock_buffer(bh);
+    if (!buffer_assoofs_verified(bh))
+    {
+        if (assoofs_dir_tail(sb, bh->b_data)->dt_checksum != assoofs_dir_csum(sb, dir_info->inode_no, bh->b_data))
+        {
+            unlock_buffer(bh);
+            printk(KERN_ERR "assoofs: directory %llu block %u checksum mismatch\n", dir_info->inode_no, lblk);
+            brelse(bh);
+            return NULL;
+        }
+        set_buffer_assoofs_verified(bh);
+    }
+    unlock_buffer(bh);
+    return bh;
+}
+
+/*
+ * Pide sin esperar los bloques lógicos first..last del directorio que no
+ * estén ya en memoria, extent a extent y con el plug puesto para que las
+ * peticiones contiguas se junten en un solo bio. Se llama con i_data_sem.
+ */
+static void assoofs_dir_readahead(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t first, uint32_t last)
+{
+    struct blk_plug plug;
+    uint64_t pblock;
+    uint32_t count;
+    uint32_t lblk = first;
+    uint32_t i;
+
+    blk_start_plug(&plug);
+    while (lblk <= last)
+    {
+        if (assoofs_map_block(sb, dir_info, lblk, &pblock, &count, NULL) || !count)
+        {
+            break;
+        }
+        count = min(count, last - lblk + 1);
+        for (i = 0; pblock && i < count; i++)
+        {
+            sb_breadahead(sb, pblock + i);
+        }
+        lblk += count;
+    }
+    blk_finish_plug(&plug);
+}
+
+// Reserva el bloque lógico lblk del directorio y lo devuelve vacío
+static struct buffer_head *assoofs_dir_new_block(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t lblk)
+{
+    struct buffer_head *bh;
+    uint64_t pblock;
+    uint32_t count;
+    int ret;
+
+    ret = assoofs_alloc_blocks(sb, dir_info, lblk, 1, 0, &pblock, &count);
+    if (ret)
+    {
+        return ERR_PTR(ret);
+    }
+
+    bh = sb_getblk(sb, pblock);
+    if (!bh)
+    {
+        return ERR_PTR(-EIO);
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    assoofs_dir_init_block(sb, bh->b_data);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    assoofs_dir_dirty(sb, dir_info, bh);
+    return bh;
+}
+
+// Posición en la raíz de la hoja que cubre hash (la última con dx_entries[i].hash <= hash)
+static uint32_t assoofs_dx_search(struct assoofs_dx_root *root, uint32_t hash)
+{
+    uint32_t lo = 1, hi = root->dx_count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (root->dx_entries[mid].hash <= hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static struct assoofs_dx_root *assoofs_dx_root(struct assoofs_inode_info *dir_info, struct buffer_head *bh)
+{
+    struct assoofs_dx_root *root = (struct assoofs_dx_root *)bh->b_data;
+
+    if (root->dx_magic != ASSOOFS_DX_MAGIC || !root->dx_count || root->dx_count > ASSOOFS_DX_MAX(bh->b_size))
+    {
+        printk(KERN_ERR "assoofs: corrupted index in directory %llu\n", dir_info->inode_no);
+        return NULL;
+    }
+    return root;
+}
+
+/*
+ * Lee el bloque donde debe estar name: el único bloque de un directorio
+ * lineal o la hoja que indica la raíz de un directorio indexado. Si idx no es
+ * NULL se devuelven también la raíz (*root_bh) y la posición de la hoja.
+ */
+static struct buffer_head *assoofs_dir_leaf(struct super_block *sb, struct assoofs_inode_info *dir_info, const struct qstr *name, struct buffer_head **root_bh, uint32_t *idx)
+{
+    struct buffer_head *bh;
+    struct assoofs_dx_root *root;
+    uint32_t i;
+
+    bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!bh || !(dir_info->flags & ASSOOFS_INODE_INDEXED))
+    {
+        return bh;
+    }
+
+    root = assoofs_dx_root(dir_info, bh);
+    if (!root)
+    {
+        brelse(bh);
+        return NULL;
+    }
+    i = assoofs_dx_search(root, assoofs_dir_hash(name->name, name->len));
+
+    if (root_bh)
+    {
+        *root_bh = bh;
+        *idx = i;
+        return assoofs_dir_bread(sb, dir_info, root->dx_entries[i].block);
+    }
+
+    i = root->dx_entries[i].block;
+    brelse(bh);
+    return assoofs_dir_bread(sb, dir_info, i);
+}
+
+// Busca name en el directorio. Devuelve el bloque (NULL si no existe) y la entrada en *res
+static struct buffer_head *assoofs_dir_find(struct inode *dir, const struct qstr *name, struct assoofs_dir_record_entry **res)
+{
+    struct buffer_head *bh;
+
+    bh = assoofs_dir_leaf(dir->i_sb, ASSOOFS_I(dir), name, NULL, NULL);
+    if (!bh)
+    {
+        return ERR_PTR(-EIO);
+    }
+
+    *res = assoofs_dir_find_entry(dir->i_sb, bh->b_data, name);
+    if (!*res)
+    {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/*
+ * El bloque de un directorio lineal se ha llenado: sus entradas pasan a la
+ * hoja 1 y el bloque 0 se convierte en la raíz del índice.
+ */
+static int assoofs_dx_convert(struct super_block *sb, struct assoofs_inode_info *dir_info, struct buffer_head *bh)
+{
+    struct buffer_head *leaf;
+    struct assoofs_dx_root *root;
+
+    leaf = assoofs_dir_new_block(sb, dir_info, 1);
+    if (IS_ERR(leaf))
+    {
+        return PTR_ERR(leaf);
+    }
+    memcpy(leaf->b_data, bh->b_data, sb->s_blocksize);
+    assoofs_dir_dirty(sb, dir_info, leaf);
+    brelse(leaf);
+
+    memset(bh->b_data, 0, sb->s_blocksize);
+    root = (struct assoofs_dx_root *)bh->b_data;
+    root->dx_magic = ASSOOFS_DX_MAGIC;
+    root->dx_count = 1;
+    root->dx_entries[0].hash = 0;
+    root->dx_entries[0].block = 1;
+    assoofs_dir_dirty(sb, dir_info, bh);
+
+    dir_info->flags |= ASSOOFS_INODE_INDEXED;
+    return assoofs_save_inode_info(sb, dir_info);
+}
+
+/*
+ * Parte la hoja idx en dos por la mediana de los hashes de sus entradas: las
+ * de hash mayor o igual pasan a una hoja nueva que se enlaza detrás en la
+ * raíz. Los nombres con el mismo hash nunca se separan.
+ */
+static int assoofs_dx_split(struct super_block *sb, struct assoofs_inode_info *dir_info, struct buffer_head *root_bh, uint32_t idx, struct buffer_head *bh)
+{
+    struct assoofs_dx_root *root = (struct assoofs_dx_root *)root_bh->b_data;
+    struct assoofs_dir_record_entry *de = NULL;
+    struct buffer_head *new_bh;
+    uint32_t *hashes;
+    uint32_t split;
+    uint32_t hash;
+    void *copy;
+    int n = 0;
     int i;
-    sb = dir->i_sb;
-    inode_remove = dentry->d_inode;
-    inode_info_remove = inode_remove->i_private;
-    parent_inode_info = dir->i_private;
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
-    dir_contents = (struct assoofs_dir_record_entry*)bh->b_data;
-    for(i = 0; parent_inode_info->dir_children_count; i++){
-        if (!strcmp(dir_contents->filename, dentry->d_name.name) && dir_contents->inode_no == inode_remove->i_ino){
-                
-            printk(KERN_INFO "Found dir_record_entry to remove: %s\n", dir_contents->filename);
-            
-            dir_contents->entry_removed = ASSOOFS_TRUE;
-            
+
+    if (root->dx_count >= ASSOOFS_DX_MAX(sb->s_blocksize))
+    {
+        printk(KERN_ERR "assoofs: directory %llu index is full\n", dir_info->inode_no);
+        return -ENOSPC;
+    }
+
+    hashes = kmalloc_array(ASSOOFS_DIR_RECORDS_PER_BLOCK(sb->s_blocksize), sizeof(*hashes), GFP_NOFS);
+    copy = kmemdup(bh->b_data, sb->s_blocksize, GFP_NOFS);
+    if (!hashes || !copy)
+    {
+        kfree(hashes);
+        kfree(copy);
+        return -ENOMEM;
+    }
+
+    while ((de = assoofs_dir_next_entry(sb, copy, de)))
+    {
+        hashes[n++] = assoofs_dir_hash(de->filename, de->name_len);
+    }
+    sort(hashes, n, sizeof(*hashes), assoofs_cmp_hash, NULL);
+
+    // Primer cambio de hash a partir de la mitad (o antes de ella si no lo hay)
+    for (i = n / 2; i < n && i > 0 && hashes[i] == hashes[i - 1]; i++)
+        ;
+    if (i == n)
+    {
+        for (i = n / 2; i > 0 && hashes[i] == hashes[i - 1]; i--)
+            ;
+    }
+    if (i == 0)
+    {
+        kfree(hashes);
+        kfree(copy);
+        return -ENOSPC;
+    }
+    split = hashes[i];
+    kfree(hashes);
+
+    new_bh = assoofs_dir_new_block(sb, dir_info, root->dx_count + 1);
+    if (IS_ERR(new_bh))
+    {
+        kfree(copy);
+        return PTR_ERR(new_bh);
+    }
+
+    assoofs_dir_init_block(sb, bh->b_data);
+    while ((de = assoofs_dir_next_entry(sb, copy, de)))
+    {
+        hash = assoofs_dir_hash(de->filename, de->name_len);
+        assoofs_dir_insert_entry(sb, hash >= split ? new_bh->b_data : bh->b_data, de->filename, de->name_len, de->inode_no, de->file_type);
+    }
+    kfree(copy);
+
+    memmove(&root->dx_entries[idx + 2], &root->dx_entries[idx + 1], (root->dx_count - idx - 1) * sizeof(root->dx_entries[0]));
+    root->dx_entries[idx + 1].hash = split;
+    root->dx_entries[idx + 1].block = root->dx_count + 1;
+    root->dx_count++;
+
+    assoofs_dir_dirty(sb, dir_info, new_bh);
+    assoofs_dir_dirty(sb, dir_info, bh);
+    assoofs_dir_dirty(sb, dir_info, root_bh);
+    brelse(new_bh);
+    return 0;
+}
+
+// Añade la entrada name -> inode_no (de tipo mode) al directorio, indexándolo o partiendo hojas si hace falta
+static int assoofs_dir_add(struct inode *dir, const struct qstr *name, uint64_t inode_no, umode_t mode)
+{
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode_info *dir_info = ASSOOFS_I(dir);
+    struct buffer_head *root_bh = NULL;
+    struct buffer_head *bh;
+    uint32_t idx;
+    int ret;
+
+    if (name->len > ASSOOFS_FILENAME_MAXLEN)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    down_write(ASSOOFS_DATA_SEM(dir));
+    for (;;)
+    {
+        bh = assoofs_dir_leaf(sb, dir_info, name, &root_bh, &idx);
+        if (!bh)
+        {
+            ret = -EIO;
+            break;
+        }
+
+        ret = assoofs_dir_insert_entry(sb, bh->b_data, name->name, name->len, inode_no, fs_umode_to_ftype(mode));
+        if (!ret)
+        {
+            assoofs_dir_dirty(sb, dir_info, bh);
+        }
+        else if (ret == -ENOSPC)
+        {
+            if (dir_info->flags & ASSOOFS_INODE_INDEXED)
+            {
+                ret = assoofs_dx_split(sb, dir_info, root_bh, idx, bh);
+            }
+            else
+            {
+                ret = assoofs_dx_convert(sb, dir_info, bh);
+            }
+            // Con sitio libre el siguiente intento ya entra
+            ret = ret ? ret : -EAGAIN;
+        }
+
+        brelse(bh);
+        brelse(root_bh);
+        root_bh = NULL;
+        if (ret != -EAGAIN)
+        {
             break;
         }
-    
-        dir_contents++;
     }
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
-    assoofs_sb_set_a_freeinode(sb, inode_info_remove->inode_no);
-    assoofs_sb_set_a_freeblock(sb, inode_info_remove->data_block_number);
-    return 0;
-
-}
-
-int assoofs_sb_set_a_freeinode(struct super_block *sb, unsigned long inode_no){
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    assoofs_sb->free_inodes |= (1 << inode_no);
-    assoofs_save_sb_info(sb);
-    return 0;
-}
-
-int assoofs_sb_set_a_freeblock(struct super_block *sb, uint64_t block){
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    assoofs_sb->free_blocks |= (1 << block);
-    assoofs_save_sb_info(sb);
-    return 0;
+    if (!ret)
+    {
+        dir_info->dir_children_count++;
+        ret = assoofs_save_inode_info(sb, dir_info);
+    }
+    up_write(ASSOOFS_DATA_SEM(dir));
+    return ret;
 }
 
-
+/*
+ * Compactación de directorios (ASSOOFS_IOC_COMPACT_DIR)
+ *
+ * Es lo único que mueve entradas que ya existen dentro de su bloque. En un
+ * directorio lineal junta los huecos de su bloque al final. Dos hojas vecinas en la raíz cubren rangos de hash seguidos: si sus
+ * entradas caben en una, se juntan en la primera y la segunda sale del
+ * índice. Las hojas tienen que seguir siendo los bloques lógicos
+ * 1..dx_count, así que el bloque que queda libre lo ocupa la última hoja y se
+ * libera el último. Cada paso es una transacción pequeña para que un
+ * directorio grande no necesite una enorme. Las posiciones de readdir van
+ * por hash, así que una lectura del directorio que esté a medias no nota que
+ * las entradas cambian de bloque.
+ */
+#define ASSOOFS_COMPACT_CREDITS(sb) (assoofs_truncate_credits(sb) + 4)
 
 /*
- *  Operaciones sobre ficheros
-*/
+ * Añade al final de dst, compactado, las entradas de src. Si no caben
+ * (-ENOSPC) o alguno está roto (-EIO) no toca ninguno de los dos; src no se
+ * toca nunca.
+ */
+static int assoofs_dir_merge_block(struct super_block *sb, void *dst, void *src)
+{
+    struct assoofs_dir_record_entry *last = NULL;
+    struct assoofs_dir_record_entry *de = NULL;
+    unsigned int end = ASSOOFS_DIR_BLOCK_DATA(sb->s_blocksize);
+    unsigned int len;
+    int dst_len, src_len;
+
+    dst_len = assoofs_dir_used(sb, dst);
+    src_len = dst_len < 0 ? dst_len : assoofs_dir_used(sb, src);
+    if (src_len < 0)
+    {
+        return -EIO;
+    }
+    if (dst_len + src_len > end)
+    {
+        return -ENOSPC;
+    }
 
-ssize_t assoofs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos);
-const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
-    .write = assoofs_write,
-};
+    dst_len = assoofs_dir_compact_block(sb, dst, &last);
+    while ((de = assoofs_dir_next_entry(sb, src, de)))
+    {
+        len = ASSOOFS_DIR_REC_LEN(de->name_len);
+        if (last)
+        {
+            last->rec_len = ASSOOFS_DIR_REC_LEN(last->name_len);
+        }
+        // Cada entrada que se añade es la última y llega hasta el final del bloque
+        last = dst + dst_len;
+        memcpy(last, de, len);
+        last->rec_len = end - dst_len;
+        dst_len += len;
+    }
+    assoofs_dir_tail(sb, dst)->dt_free = end - dst_len;
+    return 0;
+}
 
-ssize_t assoofs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+// Con una sola hoja el índice sobra: la hoja vuelve al bloque 0 y el directorio es lineal otra vez
+static int assoofs_dx_unindex(struct super_block *sb, struct assoofs_inode_info *dir_info, struct buffer_head *root_bh)
 {
-    struct assoofs_inode_info *inode_info;
+    struct assoofs_dx_root *root = (struct assoofs_dx_root *)root_bh->b_data;
     struct buffer_head *bh;
-    int nBytes;
-    char *buffer;
+    int ret;
 
-    printk(KERN_INFO "Read request\n");
+    bh = assoofs_dir_bread(sb, dir_info, root->dx_entries[0].block);
+    if (!bh)
+    {
+        return -EIO;
+    }
+    memcpy(root_bh->b_data, bh->b_data, sb->s_blocksize);
+    brelse(bh);
+    assoofs_dir_dirty(sb, dir_info, root_bh);
 
-    inode_info = filp->f_path.dentry->d_inode->i_private;
+    dir_info->flags &= ~ASSOOFS_INODE_INDEXED;
+    ret = assoofs_truncate_extents(sb, dir_info, 1);
+    assoofs_save_inode_info(sb, dir_info);
+    return ret;
+}
 
-    if (*ppos >= inode_info->file_size)
+/*
+ * Un paso de la compactación: a partir de la hoja *pos busca dos vecinas que
+ * quepan en una y las junta. Devuelve 1 si ha juntado dos (y deja en *pos
+ * por dónde seguir), 0 si ya no queda nada que juntar y un error si falla.
+ * Se llama con i_data_sem del directorio en escritura.
+ */
+static int assoofs_dx_compact_step(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t *pos)
+{
+    struct buffer_head *root_bh;
+    struct buffer_head *bh = NULL;
+    struct buffer_head *next_bh = NULL;
+    struct buffer_head *last_bh = NULL;
+    struct assoofs_dx_root *root;
+    unsigned int end = ASSOOFS_DIR_BLOCK_DATA(sb->s_blocksize);
+    uint32_t i, j, lblk, last;
+    int ret = 0;
+
+    root_bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!root_bh)
     {
-        return 0;
+        return -EIO;
+    }
+    root = assoofs_dx_root(dir_info, root_bh);
+    if (!root)
+    {
+        brelse(root_bh);
+        return -EIO;
+    }
+    if (root->dx_count == 1)
+    {
+        ret = assoofs_dx_unindex(sb, dir_info, root_bh);
+        brelse(root_bh);
+        return ret;
     }
 
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-
-    buffer = (char *)bh->b_data;
+    // dt_free de cada hoja dice si caben sin recorrerlas
+    for (i = *pos; i + 1 < root->dx_count; i++)
+    {
+        bh = assoofs_dir_bread(sb, dir_info, root->dx_entries[i].block);
+        next_bh = bh ? assoofs_dir_bread(sb, dir_info, root->dx_entries[i + 1].block) : NULL;
+        if (!next_bh)
+        {
+            ret = -EIO;
+            goto out;
+        }
+        if (assoofs_dir_tail(sb, bh->b_data)->dt_free + assoofs_dir_tail(sb, next_bh->b_data)->dt_free >= end)
+        {
+            break;
+        }
+        brelse(bh);
+        brelse(next_bh);
+        bh = next_bh = NULL;
+    }
+    if (!bh)
+    {
+        goto out;
+    }
 
-    buffer += *ppos;
+    lblk = root->dx_entries[i + 1].block;
+    last = root->dx_count;
+    if (lblk != last)
+    {
+        last_bh = assoofs_dir_bread(sb, dir_info, last);
+        if (!last_bh)
+        {
+            ret = -EIO;
+            goto out;
+        }
+    }
 
-    nBytes = min((size_t)inode_info->file_size - (size_t)*ppos, len);
+    ret = assoofs_dir_merge_block(sb, bh->b_data, next_bh->b_data);
+    if (ret)
+    {
+        // dt_free no cuadraba con lo que había: las dos hojas siguen como estaban y se sigue por la siguiente
+        *pos = i + 1;
+        ret = ret == -ENOSPC ? 1 : ret;
+        goto out;
+    }
+    assoofs_dir_dirty(sb, dir_info, bh);
 
-    if (copy_to_user(buf, buffer, nBytes) != 0)
+    memmove(&root->dx_entries[i + 1], &root->dx_entries[i + 2], (root->dx_count - i - 2) * sizeof(root->dx_entries[0]));
+    root->dx_count--;
+    if (last_bh)
     {
-        brelse(bh);
-        return -EFAULT;
+        // La última hoja pasa al bloque lógico que ha quedado libre
+        memcpy(next_bh->b_data, last_bh->b_data, sb->s_blocksize);
+        assoofs_dir_dirty(sb, dir_info, next_bh);
+        for (j = 0; j < root->dx_count; j++)
+        {
+            if (root->dx_entries[j].block == last)
+            {
+                root->dx_entries[j].block = lblk;
+                break;
+            }
+        }
     }
+    assoofs_dir_dirty(sb, dir_info, root_bh);
 
-    *ppos += nBytes;
+    ret = assoofs_truncate_extents(sb, dir_info, last);
+    assoofs_save_inode_info(sb, dir_info);
+    // La hoja i puede admitir también a su nueva vecina
+    *pos = i;
+    ret = ret ? ret : 1;
 
+out:
+    brelse(last_bh);
+    brelse(next_bh);
     brelse(bh);
-    return nBytes;
+    brelse(root_bh);
+    return ret;
 }
 
-ssize_t assoofs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+// Directorio lineal: junta las entradas de su único bloque y deja el sitio libre detrás de la última
+static int assoofs_dir_compact_linear(struct super_block *sb, struct assoofs_inode_info *dir_info)
 {
+    struct assoofs_dir_record_entry *last;
     struct buffer_head *bh;
-    struct assoofs_inode_info *inode_info = filp->f_path.dentry->d_inode->i_private;
-    char *buffer;
     int ret;
-    struct super_block *sb;
-    int resultMutex;
 
-    printk(KERN_INFO "Write request\n");
-    if (*ppos + len > ASSOOFS_DEFAULT_BLOCK_SIZE)
+    bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!bh)
     {
-        printk(KERN_ERR "Write request exceeds the size of the block\n");
-        return -ENOSPC;
+        return -EIO;
     }
-
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *)bh->b_data;
-    buffer += *ppos;
-    ret = copy_from_user(buffer, buf, len);
-
-    if (ret != 0)
+    ret = assoofs_dir_compact_block(sb, bh->b_data, &last);
+    if (ret >= 0)
     {
-
-        return -EFAULT;
-    }
-
-    *ppos += len;
-
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
+        assoofs_dir_dirty(sb, dir_info, bh);
+        ret = 0;
     }
+    brelse(bh);
+    return ret;
+}
 
+// Junta las hojas de un directorio indexado mientras se pueda, un paso por transacción; uno lineal se compacta de una vez
+static int assoofs_dir_compact(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode_info *dir_info = ASSOOFS_I(dir);
+    struct assoofs_handle *handle;
+    uint32_t pos = 0;
+    int ret, err;
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    mutex_unlock(&assoofs_sb_lock);
+    do
+    {
+        handle = assoofs_journal_start(sb, ASSOOFS_COMPACT_CREDITS(sb));
+        down_write(ASSOOFS_DATA_SEM(dir));
+        ret = (dir_info->flags & ASSOOFS_INODE_INDEXED) ? assoofs_dx_compact_step(sb, dir_info, &pos) : assoofs_dir_compact_linear(sb, dir_info);
+        up_write(ASSOOFS_DATA_SEM(dir));
+        err = assoofs_journal_stop(handle);
+        ret = ret < 0 ? ret : err ? err : ret;
+        cond_resched();
+    } while (ret > 0);
 
+    return ret;
+}
 
-    inode_info->file_size = *ppos;
-    sb = filp->f_path.dentry->d_inode->i_sb;
-    assoofs_save_inode_info(sb, inode_info);
+static long assoofs_dir_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct inode *dir = file_inode(filp);
+    int ret;
 
-    return len;
+    switch (cmd)
+    {
+    case ASSOOFS_IOC_COMPACT_DIR:
+        if (!inode_owner_or_capable(file_mnt_user_ns(filp), dir))
+        {
+            return -EPERM;
+        }
+        ret = mnt_want_write_file(filp);
+        if (ret)
+        {
+            return ret;
+        }
+        ret = assoofs_dir_compact(dir);
+        mnt_drop_write_file(filp);
+        return ret;
+    default:
+        return -ENOTTY;
+    }
 }
 
 /*
@@ -188,72 +5081,110 @@ ssize_t assoofs_write(struct file *filp, const char __user *buf, size_t len, lof
 const struct file_operations assoofs_dir_operations = {
     .owner = THIS_MODULE,
     .iterate = assoofs_iterate,
+    .unlocked_ioctl = assoofs_dir_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx)
+#define ASSOOFS_DIR_READAHEAD 32  /* hojas de directorio que se piden por adelantado en cada readdir */
+
+static int assoofs_do_iterate(struct file *filp, struct dir_context *ctx)
 {
 
     struct inode *inode;
     struct super_block *sb;
     struct assoofs_inode_info *inode_info;
+    struct assoofs_dx_root *root = NULL;
+    struct buffer_head *root_bh = NULL;
     struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    int i;
-
-    printk(KERN_INFO "Iterate request\n");
+    struct assoofs_dir_pos *ents;
+    struct blk_plug plug;
+    uint32_t i, j, count;
+    bool more = true;
+    int ret = 0;
 
     inode = filp->f_path.dentry->d_inode;
 
 
     sb = inode->i_sb;
 
-    inode_info = inode->i_private;
+    inode_info = ASSOOFS_I(inode);
 
-    if (ctx->pos)
+    if ((!S_ISDIR(inode_info->mode)))
     {
-        return 0;
+        return -1;
     }
 
-    if ((!S_ISDIR(inode_info->mode)))
+    // ctx->pos es la posición (hash) de la siguiente entrada; las hojas van en orden de hash en la raíz
+    if (ctx->pos >= ASSOOFS_DIR_EOF)
     {
-        return -1;
+        return 0;
+    }
+    ents = kmalloc_array(ASSOOFS_DIR_POS_MAX(sb->s_blocksize), sizeof(*ents), GFP_NOFS);
+    if (!ents)
+    {
+        return -ENOMEM;
     }
 
-    bh = sb_bread(sb, inode_info->data_block_number);
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
-    for (i = 0; i < inode_info->dir_children_count; i++)
+    i = 0;
+    count = 1;
+    down_read(ASSOOFS_DATA_SEM(inode));
+    if (inode_info->flags & ASSOOFS_INODE_INDEXED)
     {
-        if(record->entry_removed == ASSOOFS_FALSE){
-            dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-            ctx->pos += sizeof(struct assoofs_dir_record_entry);
+        root_bh = assoofs_dir_bread(sb, inode_info, 0);
+        root = root_bh ? assoofs_dx_root(inode_info, root_bh) : NULL;
+        if (!root)
+        {
+            ret = -EIO;
+            goto out;
         }
+        i = assoofs_dx_search(root, (uint32_t)ctx->pos << 1);
+        count = root->dx_count;
 
-        record++;
+        // Las hojas se leen una detrás de otra: se piden de golpe antes de esperar a la primera
+        blk_start_plug(&plug);
+        for (j = i; j < count && j < i + ASSOOFS_DIR_READAHEAD; j++)
+        {
+            assoofs_dir_readahead(sb, inode_info, root->dx_entries[j].block, root->dx_entries[j].block);
+        }
+        blk_finish_plug(&plug);
     }
 
-    brelse(bh);
+    for (; more && i < count; i++)
+    {
+        bh = assoofs_dir_bread(sb, inode_info, root ? root->dx_entries[i].block : 0);
+        if (!bh)
+        {
+            ret = -EIO;
+            goto out;
+        }
+        more = assoofs_dir_emit_block(sb, ctx, bh->b_data, ents);
+        brelse(bh);
+    }
+    if (more)
+    {
+        ctx->pos = ASSOOFS_DIR_EOF;
+    }
 
-    return 0;
+out:
+    up_read(ASSOOFS_DATA_SEM(inode));
+    brelse(root_bh);
+    kfree(ents);
+    return ret;
 }
 
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx)
+{
+    struct inode *inode = file_inode(filp);
+    loff_t pos = ctx->pos;
+    u64 start = ktime_get_ns();
+    int ret;
 
-int assoofs_sb_get_a_freeinode(struct super_block *sb, unsigned long *inode){
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    int i;
-    for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++){
-        if (assoofs_sb->free_inodes & (1 << i)){
-            break;
-        }
-    }
-    if(i >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-        return -1;
-    }
-    *inode = i;
-    assoofs_sb->free_inodes &= ~(1 << i);
-    assoofs_save_sb_info(sb);
-    return 0;
+    ret = assoofs_do_iterate(filp, ctx);
+    assoofs_op_done(inode->i_sb, ASSOOFS_OP_ITERATE, inode->i_ino, pos, ctx->pos - pos, ret, start);
+    return ret;
 }
 
+
 /*
  *  Operaciones sobre inodos
  */
@@ -267,377 +5198,634 @@ static struct inode_operations assoofs_inode_ops = {
 static struct inode *assoofs_get_inode(struct super_block *sb, int ino)
 {
     // PAso 1
-    struct inode *inode = new_inode(sb);
-    struct assoofs_inode_info *inode_info = assoofs_get_inode_info(sb, ino);
+    struct inode *inode;
+    struct assoofs_inode_info *inode_info;
+
+    // Si el inodo ya está en la caché de inodos de la VFS se usa tal cual, sin E/S ni reservas
+    inode = iget_locked(sb, ino);
+    if (!inode)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+    if (!(inode->i_state & I_NEW))
+    {
+        return inode;
+    }
+
+    inode_info = ASSOOFS_I(inode);
+    if (assoofs_read_inode_info(sb, ino, inode_info))
+    {
+        iget_failed(inode);
+        return ERR_PTR(-EIO);
+    }
+
     // PASO 2
     if (S_ISDIR(inode_info->mode))
     {
-        inode->i_ino = ino;
-        inode->i_sb = sb;
         inode->i_op = &assoofs_inode_ops;
         inode->i_fop = &assoofs_dir_operations;
-        inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-        inode->i_private = inode_info;
     }
     else if (S_ISREG(inode_info->mode))
     {
-        inode->i_ino = ino;
-        inode->i_sb = sb;
-        inode->i_op = &assoofs_inode_ops;
+        if (assoofs_compressed(inode_info) && !assoofs_cluster_fits(sb))
+        {
+            printk(KERN_ERR "assoofs: compressed inode %llu has clusters smaller than a page\n", inode_info->inode_no);
+            iget_failed(inode);
+            return ERR_PTR(-EOPNOTSUPP);
+        }
+        inode->i_op = &assoofs_file_inode_ops;
         inode->i_fop = &assoofs_file_operations;
-        inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-        inode->i_private = inode_info;
+        inode->i_mapping->a_ops = &assoofs_aops;
+        inode->i_size = inode_info->file_size;
     }
     else
     {
         printk(KERN_ERR "Unknown inode type. Neither a directory nor a file\n");
+        iget_failed(inode);
+        return ERR_PTR(-EIO);
     }
+    inode_init_owner(sb->s_user_ns, inode, NULL, inode_info->mode);
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
 
     // PASO 3
+    unlock_new_inode(inode);
     return inode;
 }
 
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
+static struct dentry *assoofs_do_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
 {
 
-    struct assoofs_inode_info *parent_info;
     struct super_block *sb;
     struct buffer_head *bh;
     struct assoofs_dir_record_entry *record;
-    int i;
-
-    printk(KERN_INFO "Lookup request\n");
+    struct inode *inode = NULL;
+    uint64_t inode_no;
 
-    parent_info = parent_inode->i_private;
     sb = parent_inode->i_sb;
-    bh = sb_bread(sb, parent_info->data_block_number);
-
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
-    for (i = 0; i < parent_info->dir_children_count; i++)
+    if (child_dentry->d_name.len > ASSOOFS_FILENAME_MAXLEN)
     {
-        if ((!strcmp(record->filename, child_dentry->d_name.name)) && record->entry_removed == ASSOOFS_FALSE)
-        {
-            struct inode *inode = assoofs_get_inode(sb, record->inode_no);
-            inode_init_owner(sb->s_user_ns, inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);
-            d_add(child_dentry, inode);
-            return NULL;
-        }
-        record++;
-    }
-
-    return NULL;
-}
-
-void assoofs_save_sb_info(struct super_block *vsb)
-{
-    int resultMutex;
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *sb = vsb->s_fs_info;
-    bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    bh->b_data = (char *)sb;
-
-
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
+        return ERR_PTR(-ENAMETOOLONG);
     }
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    mutex_unlock(&assoofs_sb_lock);
 
-    brelse(bh);
-}
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block)
-{
-    struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
-    int i;
-    for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
+    // Solo se lee el bloque (o la raíz del índice y una hoja) donde puede estar el nombre
+    down_read(ASSOOFS_DATA_SEM(parent_inode));
+    bh = assoofs_dir_find(parent_inode, &child_dentry->d_name, &record);
+    if (!IS_ERR_OR_NULL(bh))
     {
-        if (afs_sb->free_blocks & (1 << i))
-        {
-            break;
-        }
+        inode_no = record->inode_no;
+        brelse(bh);
     }
-    if (i == ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+    up_read(ASSOOFS_DATA_SEM(parent_inode));
+    if (IS_ERR(bh))
     {
-        printk(KERN_ERR "No free blocks available\n");
-        return -1;
+        return ERR_CAST(bh);
     }
-    *block = i;
+    if (bh)
+    {
 
-    afs_sb->free_blocks &= ~(1 << i);
-    assoofs_save_sb_info(sb);
+        inode = assoofs_get_inode(sb, inode_no);
+        if (IS_ERR(inode))
+        {
+            return ERR_CAST(inode);
+        }
+    }
 
-    return 0;
+    /*
+     * Si no existe, la dentry queda en la caché como negativa: los siguientes
+     * lookup del mismo nombre no llegan aquí. create y mkdir la convierten en
+     * positiva con d_instantiate_new y unlink la deja negativa otra vez.
+     */
+    return d_splice_alias(inode, child_dentry);
 }
 
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode)
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
 {
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    struct assoofs_inode_info *inode_info;
-    int resultMutex;
-
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
-    inode_info += assoofs_sb->inodes_count;
-    memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
-
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
-    }
-
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    mutex_unlock(&assoofs_sb_lock);
+    u64 start = ktime_get_ns();
+    struct dentry *ret;
 
-    if (assoofs_sb->inodes_count < inode->inode_no){
-        assoofs_sb->inodes_count++;
-        assoofs_save_sb_info(sb);
-    }
+    ret = assoofs_do_lookup(parent_inode, child_dentry, flags);
+    // Resultado: 0 si existe, -ENOENT si no o el error
+    assoofs_op_done(parent_inode->i_sb, ASSOOFS_OP_LOOKUP, parent_inode->i_ino, 0, child_dentry->d_name.len,
+                    IS_ERR(ret) ? PTR_ERR(ret) : d_really_is_positive(ret ? ret : child_dentry) ? 0 : -ENOENT, start);
+    return ret;
 }
 
-
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search)
+/*
+ * Tabla de inodos: el inodo número n ocupa siempre la posición n, así que su
+ * bloque y su desplazamiento se calculan directamente sin recorrer la tabla.
+ */
+static struct assoofs_inode_info *assoofs_inode_slot(struct super_block *sb, uint64_t inode_no, struct buffer_head **bhp)
 {
-    uint64_t count = 0;
+    struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb)->s_as;
+    struct buffer_head *bh;
 
-    while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count)
+    if (inode_no >= assoofs_sb->max_inodes)
     {
-        count++;
-        start++;
+        printk(KERN_ERR "assoofs: inode number %llu out of range\n", inode_no);
+        return NULL;
     }
 
-    if (start->inode_no == search->inode_no)
-    {
-        return start;
-    }
-    else
+    bh = assoofs_bread(sb, assoofs_sb->inode_table_block + inode_no / ASSOOFS_INODES_PER_BLOCK(sb->s_blocksize));
+    if (!bh)
     {
         return NULL;
     }
+
+    *bhp = bh;
+    return (struct assoofs_inode_info *)bh->b_data + inode_no % ASSOOFS_INODES_PER_BLOCK(sb->s_blocksize);
+}
+
+void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode)
+{
+    assoofs_save_inode_info(sb, inode);
 }
 
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info)
 {
     struct buffer_head *bh;
     struct assoofs_inode_info *inode_pos;
-    int resultMutex;
 
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+    inode_pos = assoofs_inode_slot(sb, inode_info->inode_no, &bh);
 
     if (inode_pos == NULL)
     {
         printk(KERN_ERR "The inode to be saved does not exist\n");
-        return -1;
+        return -EIO;
     }
 
+    // El bloque lo comparten varios inodos: se bloquea solo el buffer mientras se copia
+    lock_buffer(bh);
     memcpy(inode_pos, inode_info, sizeof(*inode_pos));
+    inode_pos->checksum = assoofs_inode_csum(sb, inode_pos);
+    unlock_buffer(bh);
 
+    assoofs_journal_dirty(sb, bh);
 
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
-    }
-
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    mutex_unlock(&assoofs_sb_lock);
-
+    brelse(bh);
     return 0;
 }
 
-static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+static int assoofs_do_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
 {
     struct inode *inode;
-    uint64_t count;
     struct super_block *sb;
     struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    struct buffer_head *bh;
-    int resultMutexStorage;
-    int resultMutex;
-
+    struct assoofs_handle *handle;
+    int ret;
 
-    printk(KERN_INFO "New file request\n");
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
-    }
     sb = dir->i_sb;
-    mutex_unlock(&assoofs_sb_lock);
+    // Todo lo que cambia al crear (mapas, superbloque, tabla de inodos y directorio) va en una transacción
+    handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
 
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
     inode = new_inode(sb);
+    if (!inode)
+    {
+        assoofs_journal_stop(handle);
+        return -ENOMEM;
+    }
     inode->i_sb = sb;
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
     inode->i_op = &assoofs_inode_ops;
-    assoofs_sb_get_a_freeinode(sb, &inode->i_ino);
 
-    if (count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+    if (assoofs_sb_get_a_freeinode(sb, &inode->i_ino))
     {
         printk(KERN_ERR "assoofs_create: max number of objects reached\n");
-        return -1;
+        iput(inode);
+        assoofs_journal_stop(handle);
+        return -ENOSPC;
     }
-
-
-    resultMutexStorage = mutex_lock_interruptible(&assoofs_storageInodos_lock);
-    if(resultMutexStorage != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
+    // A partir de aquí, si algo falla, evict_inode devuelve el número y los bloques al quitarle el enlace
+    if (insert_inode_locked(inode) < 0)
+    {
+        printk(KERN_ERR "assoofs: inode %lu is already in use\n", inode->i_ino);
+        assoofs_sb_set_a_freeinode(sb, inode->i_ino);
+        iput(inode);
+        assoofs_journal_stop(handle);
+        return -EIO;
     }
 
-    // inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    mutex_unlock(&assoofs_storageInodos_lock);
+    // La copia en memoria del inodo va dentro del propio struct inode (assoofs_alloc_inode)
+    inode_info = ASSOOFS_I(inode);
     inode_info->inode_no = inode->i_ino;
     inode_info->mode = mode;
     inode_info->file_size = 0;
-    inode->i_private = inode_info;
+    // Empieza con los datos en línea hasta que pase de ASSOOFS_INLINE_DATA_MAX
+    inode_info->flags = ASSOOFS_INODE_INLINE;
+    if (READ_ONCE(ASSOOFS_SB(sb)->s_compress))
+    {
+        inode_info->flags |= ASSOOFS_INODE_COMPRESSED;
+    }
 
+    inode->i_op = &assoofs_file_inode_ops;
     inode->i_fop = &assoofs_file_operations;
+    inode->i_mapping->a_ops = &assoofs_aops;
     inode_init_owner(sb->s_user_ns, inode, dir, mode);
-    d_add(dentry, inode);
 
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
+    // Los bloques de datos se reservan al escribir más de lo que cabe en el inodo (assoofs_alloc_blocks)
 
     assoofs_add_inode_info(sb, inode_info);
 
     // PASO 2
-
-    parent_inode_info = dir->i_private;
-
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
-    }
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
-    mutex_unlock(&assoofs_sb_lock);
-
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
-    dir_contents->inode_no = inode_info->inode_no;
-
-    strcpy(dir_contents->filename, dentry->d_name.name);
-
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
+    ret = assoofs_dir_add(dir, &dentry->d_name, inode_info->inode_no, inode->i_mode);
+    if (ret)
+    {
+        clear_nlink(inode);
+        discard_new_inode(inode);
+        assoofs_journal_stop(handle);
+        return ret;
     }
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    mutex_unlock(&assoofs_sb_lock);
+    // PASO 3
+    d_instantiate_new(dentry, inode);
 
-    brelse(bh);
+    // PASO 4
+    return assoofs_journal_stop(handle);
+}
 
-    // PASO 3
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
+static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+{
+    u64 start = ktime_get_ns();
+    int ret;
 
-    // PASO 4
-    return 0;
+    ret = assoofs_do_create(mnt_userns, dir, dentry, mode, excl);
+    assoofs_op_done(dir->i_sb, ASSOOFS_OP_CREATE, dir->i_ino, 0, dentry->d_name.len, ret, start);
+    return ret;
 }
 
-static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+static int assoofs_do_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
 {
 
     struct buffer_head *bh;
     struct inode *inode;
-    uint64_t count;
     struct super_block *sb;
     struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    int resultMutex;
-    int resultMutexStorage;
+    struct assoofs_handle *handle;
+    int ret;
 
-    printk(KERN_INFO "New directory request\n");
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
-    }
     sb = dir->i_sb;
-    mutex_unlock(&assoofs_sb_lock);
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
+    handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
     inode = new_inode(sb);
+    if (!inode)
+    {
+        assoofs_journal_stop(handle);
+        return -ENOMEM;
+    }
     inode->i_sb = sb;
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
     inode->i_op = &assoofs_inode_ops;
-    assoofs_sb_get_a_freeinode(sb, &inode->i_ino);
 
-    if (count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+    if (assoofs_sb_get_a_freeinode(sb, &inode->i_ino))
     {
         printk(KERN_ERR "assoofs_create: max number of objects reached\n");
-        return -1;
+        iput(inode);
+        assoofs_journal_stop(handle);
+        return -ENOSPC;
     }
-
-    resultMutexStorage = mutex_lock_interruptible(&assoofs_storageInodos_lock);
-    if(resultMutexStorage != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
+    // A partir de aquí, si algo falla, evict_inode devuelve el número y los bloques al quitarle el enlace
+    if (insert_inode_locked(inode) < 0)
+    {
+        printk(KERN_ERR "assoofs: inode %lu is already in use\n", inode->i_ino);
+        assoofs_sb_set_a_freeinode(sb, inode->i_ino);
+        iput(inode);
+        assoofs_journal_stop(handle);
+        return -EIO;
     }
-    // inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    mutex_unlock(&assoofs_storageInodos_lock);
 
+    inode_info = ASSOOFS_I(inode);
     inode_info->inode_no = inode->i_ino;
     inode_info->mode = S_IFDIR | mode;
     inode_info->dir_children_count = 0;
-    inode->i_private = inode_info;
 
     inode->i_fop = &assoofs_dir_operations;
     inode_init_owner(sb->s_user_ns, inode, dir, inode_info->mode);
-    d_add(dentry, inode);
 
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
+    // El directorio nace lineal, con un único bloque vacío
+    bh = assoofs_dir_new_block(sb, inode_info, 0);
+    if (IS_ERR(bh))
+    {
+        clear_nlink(inode);
+        discard_new_inode(inode);
+        assoofs_journal_stop(handle);
+        return PTR_ERR(bh);
+    }
+    brelse(bh);
 
     assoofs_add_inode_info(sb, inode_info);
 
     // PASO 2
+    ret = assoofs_dir_add(dir, &dentry->d_name, inode_info->inode_no, inode->i_mode);
+    if (ret)
+    {
+        clear_nlink(inode);
+        discard_new_inode(inode);
+        assoofs_journal_stop(handle);
+        return ret;
+    }
+
+    // PASO 3
+    d_instantiate_new(dentry, inode);
+
+    // PASO 4
+    return assoofs_journal_stop(handle);
+}
+
+static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    u64 start = ktime_get_ns();
+    int ret;
+
+    ret = assoofs_do_mkdir(mnt_userns, dir, dentry, mode);
+    assoofs_op_done(dir->i_sb, ASSOOFS_OP_MKDIR, dir->i_ino, 0, dentry->d_name.len, ret, start);
+    return ret;
+}
 
-    parent_inode_info = dir->i_private;
+/*
+ *  Operaciones sobre el superbloque
+ */
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle;
+    uint32_t tid;
+    int ret, err;
+
+    handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+    tid = handle->h_tid;
+    // Cambia file_size: en escritura, como cualquier otro cambio del inodo
+    down_write(ASSOOFS_DATA_SEM(inode));
+    if (S_ISREG(inode_info->mode))
+    {
+        inode_info->file_size = i_size_read(inode);
+    }
+
+    ret = assoofs_save_inode_info(sb, inode_info);
+    up_write(ASSOOFS_DATA_SEM(inode));
+    err = assoofs_journal_stop(handle);
+    ret = ret ? ret : err;
+    if (ret || wbc->sync_mode != WB_SYNC_ALL)
+    {
+        return ret;
+    }
+
+    // fsync: la transacción con este inodo tiene que estar confirmada
+    return assoofs_journal_commit(sb, tid, false);
+}
 
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
+// El superbloque entra en el commit si sus contadores han cambiado
+static int assoofs_sync_fs(struct super_block *sb, int wait)
+{
+    if (wait)
+    {
+        return assoofs_journal_force(sb, false);
     }
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
-    mutex_unlock(&assoofs_sb_lock);
 
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
-    dir_contents->inode_no = inode_info->inode_no;
+    // Sin esperar: se adelanta el commit periódico
+    mod_delayed_work(system_wq, &ASSOOFS_SB(sb)->s_commit_work, 0);
+    return 0;
+}
+
+static void assoofs_put_super(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
 
-    strcpy(dir_contents->filename, dentry->d_name.name);
+    cancel_delayed_work_sync(&sbi->s_commit_work);
+    // Las conversiones pendientes abren manejadores: tienen que acabar antes del último commit
+    flush_workqueue(sbi->s_unwritten_wq);
+    // Al desmontar todo queda en su sitio y el diario vacío
+    assoofs_journal_force(sb, true);
 
-    resultMutex = mutex_lock_interruptible(&assoofs_sb_lock);
-    if(resultMutex != 0){
-        printk(KERN_ERR "Ha habido un error en el mutex");
+    // Si no se ha podido hacer el checkpoint lo confirmado sigue en el diario y se reproduce al montar
+    while (sbi->s_ckpt_count)
+    {
+        brelse(assoofs_ckpt_del(sbi, sbi->s_ckpt[0].live));
     }
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    mutex_unlock(&assoofs_sb_lock);
+    sb->s_fs_info = NULL;
+    assoofs_release_bitmap(sbi->s_inode_bitmap, sbi->s_as->inode_bitmap_blocks);
+    assoofs_release_bitmap(sbi->s_block_bitmap, sbi->s_as->block_bitmap_blocks);
+    kvfree(sbi->s_txn_buffers);
+    kvfree(sbi->s_txn_copies);
+    kvfree(sbi->s_journal_bhs);
+    kvfree(sbi->s_ckpt);
+    kvfree(sbi->s_revokes);
+    brelse(sbi->s_sbh);
+    crypto_free_shash(sbi->s_chksum_driver);
+    free_percpu(sbi->s_stats);
+    if (sbi->s_unwritten_wq)
+    {
+        destroy_workqueue(sbi->s_unwritten_wq);
+    }
+    kfree(sbi->s_as);
+    kfree(sbi);
+}
 
-    brelse(bh);
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct super_block *sb = dentry->d_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_as;
+
+    buf->f_type = ASSOOFS_MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = assoofs_sb->blocks_count;
+    buf->f_bfree = assoofs_sb->free_blocks;
+    // Lo reservado para páginas diferidas ya no está disponible
+    buf->f_bavail = assoofs_sb->free_blocks - min(assoofs_sb->free_blocks, READ_ONCE(sbi->s_reserved_blocks));
+    buf->f_files = assoofs_sb->max_inodes;
+    buf->f_ffree = assoofs_sb->free_inodes;
+    buf->f_namelen = ASSOOFS_FILENAME_MAXLEN;
+    return 0;
+}
 
-    // PASO 3
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
+static int assoofs_show_options(struct seq_file *seq, struct dentry *root)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(root->d_sb);
 
-    // PASO 4
+    if (sbi->s_commit_interval != ASSOOFS_DEFAULT_COMMIT_INTERVAL)
+    {
+        seq_printf(seq, ",commit=%u", sbi->s_commit_interval);
+    }
+    if (sbi->s_compress)
+    {
+        seq_puts(seq, ",compress");
+    }
     return 0;
 }
 
 /*
- *  Operaciones sobre el superbloque
+ * Suma los contadores de todas las CPU y los escribe: una línea con las
+ * operaciones, otra con los bytes, otra con la caché de buffers y una por
+ * operación con su histograma de latencias como pares <desde ns>:<cuántas>
+ * (solo las casillas con algo).
  */
+static int assoofs_show_op_stats(struct seq_file *seq, struct assoofs_sb_info *sbi)
+{
+    struct assoofs_stats *sum, *s;
+    unsigned int op, i;
+    int cpu;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+    {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu)
+    {
+        s = per_cpu_ptr(sbi->s_stats, cpu);
+        for (op = 0; op < ASSOOFS_OP_COUNT; op++)
+        {
+            sum->ops[op] += s->ops[op];
+            sum->bytes[op] += s->bytes[op];
+            for (i = 0; i < ASSOOFS_LATENCY_BUCKETS; i++)
+            {
+                sum->latency[op][i] += s->latency[op][i];
+            }
+        }
+        sum->bh_hits += s->bh_hits;
+        sum->bh_misses += s->bh_misses;
+    }
+
+    seq_puts(seq, "\tops:");
+    for (op = 0; op < ASSOOFS_OP_COUNT; op++)
+    {
+        seq_printf(seq, " %s %llu", assoofs_op_names[op], sum->ops[op]);
+    }
+    seq_printf(seq, "\n\tbytes: read %llu write %llu\n", sum->bytes[ASSOOFS_OP_READ], sum->bytes[ASSOOFS_OP_WRITE]);
+    seq_printf(seq, "\tbuffers: hits %llu misses %llu\n", sum->bh_hits, sum->bh_misses);
+    for (op = 0; op < ASSOOFS_OP_COUNT; op++)
+    {
+        seq_printf(seq, "\tlatency %s:", assoofs_op_names[op]);
+        for (i = 0; i < ASSOOFS_LATENCY_BUCKETS; i++)
+        {
+            if (sum->latency[op][i])
+            {
+                seq_printf(seq, " %llu:%llu", 1ULL << i, sum->latency[op][i]);
+            }
+        }
+        seq_putc(seq, '\n');
+    }
+    kfree(sum);
+    return 0;
+}
+
+static int assoofs_show_stats(struct seq_file *seq, struct dentry *root)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(root->d_sb);
+    uint64_t bytes, disk_bytes, compressed, plain;
+
+    spin_lock(&sbi->s_lock);
+    bytes = sbi->s_cluster_bytes;
+    disk_bytes = sbi->s_cluster_disk_bytes;
+    compressed = sbi->s_clusters_compressed;
+    plain = sbi->s_clusters_plain;
+    spin_unlock(&sbi->s_lock);
+
+    seq_printf(seq, "\n\tcompression: clusters %llu compressed %llu plain\n", compressed, plain);
+    seq_printf(seq, "\tcompression: bytes %llu data %llu disk", bytes, disk_bytes);
+    if (disk_bytes)
+    {
+        // Relación datos/disco con dos decimales
+        seq_printf(seq, " ratio %llu.%02llu", div64_u64(bytes, disk_bytes), div64_u64(bytes * 100, disk_bytes) % 100);
+    }
+    seq_putc(seq, '\n');
+    return assoofs_show_op_stats(seq, sbi);
+}
+
 static const struct super_operations assoofs_sops = {
     // .drop_inode = generic_delete_inode,
-    .drop_inode = assoofs_destroy_inode,
+    .alloc_inode = assoofs_alloc_inode,
+    .free_inode = assoofs_free_inode,
+    .evict_inode = assoofs_evict_inode,
+    .write_inode = assoofs_write_inode,
+    .sync_fs = assoofs_sync_fs,
+    .put_super = assoofs_put_super,
+    .statfs = assoofs_statfs,
+    .show_options = assoofs_show_options,
+    .show_stats = assoofs_show_stats,
+};
+
+// Commit periódico en modo asíncrono: confirma la transacción en curso (llega a su sitio en el checkpoint)
+static void assoofs_commit_work(struct work_struct *work)
+{
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, s_commit_work);
+
+    assoofs_journal_force(sbi->s_sb, false);
+    if (sbi->s_commit_interval && !assoofs_sync_mode(sbi->s_sb))
+    {
+        schedule_delayed_work(&sbi->s_commit_work, sbi->s_commit_interval * HZ);
+    }
+}
+
+/*
+ *  Opciones de montaje: sync, async, commit=<segundos> y compress/nocompress
+ */
+enum {
+    Opt_sync,
+    Opt_async,
+    Opt_commit,
+    Opt_compress,
+    Opt_nocompress,
+    Opt_err,
+};
+
+static const match_table_t assoofs_tokens = {
+    {Opt_sync, "sync"},
+    {Opt_async, "async"},
+    {Opt_commit, "commit=%u"},
+    {Opt_compress, "compress"},
+    {Opt_nocompress, "nocompress"},
+    {Opt_err, NULL},
 };
 
+static int assoofs_parse_options(struct super_block *sb, char *options)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int option;
+
+    if (!options)
+    {
+        return 0;
+    }
+
+    while ((p = strsep(&options, ",")) != NULL)
+    {
+        if (!*p)
+        {
+            continue;
+        }
+
+        switch (match_token(p, assoofs_tokens, args))
+        {
+        case Opt_sync:
+            sb->s_flags |= SB_SYNCHRONOUS;
+            break;
+        case Opt_async:
+            sb->s_flags &= ~SB_SYNCHRONOUS;
+            break;
+        case Opt_commit:
+            if (match_int(&args[0], &option) || option < 0)
+            {
+                printk(KERN_ERR "assoofs: invalid commit interval\n");
+                return -EINVAL;
+            }
+            sbi->s_commit_interval = option;
+            break;
+        case Opt_compress:
+            sbi->s_compress = true;
+            break;
+        case Opt_nocompress:
+            sbi->s_compress = false;
+            break;
+        default:
+            printk(KERN_ERR "assoofs: unrecognized mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
 /*
  *  Inicialización del superbloque
  */
@@ -646,77 +5834,267 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent)
         
     // 1.- Leer la información persistente del superbloque del dispositivo de bloques
     struct assoofs_super_block_info *assoofs_sb;
+    struct assoofs_sb_info *sbi;
+    struct crypto_shash *chksum;
     struct buffer_head *bh;
     struct inode *root_inode;
+    uint64_t block_size;
+    int ret;
 
     printk(KERN_INFO "assoofs_fill_super request\n");
 
+    // El superbloque está al principio del dispositivo: se lee con el bloque más pequeño para saber el de verdad
+    if (!sb_min_blocksize(sb, ASSOOFS_MIN_BLOCK_SIZE))
+    {
+        printk(KERN_ERR "assoofs_fill_super: unable to set the block size\n");
+        return -EINVAL;
+    }
     bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+    if (!bh)
+    {
+        return -EIO;
+    }
 
     assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
+    block_size = assoofs_sb->block_size;
     // 2.- Comprobar los parámetros del superbloque
-    if (ASSOOFS_MAGIC != assoofs_sb->magic || ASSOOFS_DEFAULT_BLOCK_SIZE != assoofs_sb->block_size)
+    if (ASSOOFS_MAGIC != assoofs_sb->magic || block_size < ASSOOFS_MIN_BLOCK_SIZE || block_size > ASSOOFS_MAX_BLOCK_SIZE ||
+        !is_power_of_2(block_size))
     {
         printk(KERN_ERR "assoofs_fill_super: wrong magic number or block size\n");
+        brelse(bh);
         return -1;
     }
+    if (ASSOOFS_VERSION != assoofs_sb->version)
+    {
+        printk(KERN_ERR "assoofs_fill_super: unsupported version %llu, run mkassoofs again\n", assoofs_sb->version);
+        brelse(bh);
+        return -EINVAL;
+    }
+    if (block_size != sb->s_blocksize)
+    {
+        brelse(bh);
+        // La caché de buffers no admite bloques más grandes que una página
+        if (!sb_set_blocksize(sb, block_size))
+        {
+            printk(KERN_ERR "assoofs_fill_super: block size %llu not supported by this device or page size\n", block_size);
+            return -EINVAL;
+        }
+        bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+        if (!bh)
+        {
+            return -EIO;
+        }
+        assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
+    }
+    chksum = crypto_alloc_shash("crc32c", 0, 0);
+    if (IS_ERR(chksum))
+    {
+        printk(KERN_ERR "assoofs_fill_super: unable to load the crc32c driver\n");
+        brelse(bh);
+        return PTR_ERR(chksum);
+    }
+    // Antes de fiarse de ningún otro campo
+    if (assoofs_sb->checksum != assoofs_sb_csum(chksum, assoofs_sb))
+    {
+        printk(KERN_ERR "assoofs_fill_super: superblock checksum mismatch\n");
+        crypto_free_shash(chksum);
+        brelse(bh);
+        return -EBADMSG;
+    }
+    if (assoofs_sb->blocks_count > bdev_nr_bytes(sb->s_bdev) >> sb->s_blocksize_bits ||
+        assoofs_sb->inode_bitmap_blocks * ASSOOFS_BITS_PER_BLOCK(block_size) < assoofs_sb->max_inodes ||
+        assoofs_sb->block_bitmap_blocks * ASSOOFS_BITS_PER_BLOCK(block_size) < assoofs_sb->blocks_count ||
+        assoofs_sb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(block_size) < assoofs_sb->max_inodes ||
+        assoofs_sb->inode_table_block + assoofs_sb->inode_table_blocks > assoofs_sb->journal_block ||
+        assoofs_sb->journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS ||
+        assoofs_sb->journal_block + assoofs_sb->journal_blocks > assoofs_sb->first_data_block ||
+        assoofs_sb->first_data_block >= assoofs_sb->blocks_count)
+    {
+        printk(KERN_ERR "assoofs_fill_super: inconsistent filesystem geometry\n");
+        crypto_free_shash(chksum);
+        brelse(bh);
+        return -EINVAL;
+    }
 
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo
     // s_op con las operaciones que soporta.
     sb->s_magic = ASSOOFS_MAGIC;
-    sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb->s_maxbytes = (loff_t)U32_MAX << sb->s_blocksize_bits;
     sb->s_op = &assoofs_sops;
-    sb->s_fs_info = assoofs_sb;
+
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if (!sbi)
+    {
+        crypto_free_shash(chksum);
+        brelse(bh);
+        return -ENOMEM;
+    }
+    sbi->s_as = kmemdup(assoofs_sb, sizeof(*assoofs_sb), GFP_KERNEL);
+    if (!sbi->s_as)
+    {
+        crypto_free_shash(chksum);
+        brelse(bh);
+        kfree(sbi);
+        return -ENOMEM;
+    }
+    // El bloque 0 se queda en memoria: los commits solo copian en él los contadores
+    sbi->s_sbh = bh;
+    sbi->s_sb = sb;
+    sbi->s_chksum_driver = chksum;
+    spin_lock_init(&sbi->s_lock);
+    sbi->s_commit_interval = ASSOOFS_DEFAULT_COMMIT_INTERVAL;
+    sbi->s_block_hint = sbi->s_as->first_data_block;
+    sbi->s_inode_hint = ASSOOFS_ROOTDIR_INODE_NUMBER + 1;
+    INIT_DELAYED_WORK(&sbi->s_commit_work, assoofs_commit_work);
+    spin_lock_init(&sbi->s_unwritten_lock);
+    INIT_WORK(&sbi->s_unwritten_work, assoofs_unwritten_work);
+    spin_lock_init(&sbi->s_journal_lock);
+    mutex_init(&sbi->s_commit_mutex);
+    init_waitqueue_head(&sbi->s_journal_wait);
+    sb->s_fs_info = sbi;
+
+    sbi->s_stats = alloc_percpu(struct assoofs_stats);
+    // Terminar la escritura de una página puede necesitarlo para liberar memoria
+    sbi->s_unwritten_wq = alloc_workqueue("assoofs-unwritten", WQ_MEM_RECLAIM, 0);
+    if (!sbi->s_stats || !sbi->s_unwritten_wq)
+    {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    ret = assoofs_parse_options(sb, data);
+    if (ret)
+    {
+        goto out_free;
+    }
+    if (sbi->s_compress && !assoofs_cluster_fits(sb))
+    {
+        printk(KERN_ERR "assoofs_fill_super: compress needs clusters of at least one page\n");
+        ret = -EINVAL;
+        goto out_free;
+    }
+
+    // La transacción más grande que cabe en el diario vacío (el bloque 0 es su superbloque)
+    sbi->s_txn_max = sbi->s_as->journal_blocks - 2;
+    while (assoofs_journal_space(sb, sbi->s_txn_max) > sbi->s_as->journal_blocks - 1)
+    {
+        sbi->s_txn_max--;
+    }
+    sbi->s_txn_buffers = kvcalloc(sbi->s_txn_max, sizeof(*sbi->s_txn_buffers), GFP_KERNEL);
+    sbi->s_txn_copies = kvcalloc(sbi->s_txn_max, sizeof(*sbi->s_txn_copies), GFP_KERNEL);
+    sbi->s_journal_bhs = kvcalloc(sbi->s_as->journal_blocks, sizeof(*sbi->s_journal_bhs), GFP_KERNEL);
+    // Cada pendiente de checkpoint tiene su copia en un bloque distinto del diario
+    sbi->s_ckpt = kvcalloc(sbi->s_as->journal_blocks, sizeof(*sbi->s_ckpt), GFP_KERNEL);
+    // Solo se revoca lo que estaba pendiente de checkpoint
+    sbi->s_revokes = kvcalloc(sbi->s_as->journal_blocks, sizeof(*sbi->s_revokes), GFP_KERNEL);
+    if (!sbi->s_txn_buffers || !sbi->s_txn_copies || !sbi->s_journal_bhs || !sbi->s_ckpt || !sbi->s_revokes)
+    {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    // Antes de leer los mapas: lo que haya en el diario puede cambiarlos
+    ret = assoofs_journal_load(sb);
+    if (ret)
+    {
+        printk(KERN_ERR "assoofs_fill_super: unable to recover the journal\n");
+        goto out_free;
+    }
+
+    sbi->s_inode_bitmap = assoofs_load_bitmap(sb, sbi->s_as->inode_bitmap_block, sbi->s_as->inode_bitmap_blocks);
+    sbi->s_block_bitmap = assoofs_load_bitmap(sb, sbi->s_as->block_bitmap_block, sbi->s_as->block_bitmap_blocks);
+    if (!sbi->s_inode_bitmap || !sbi->s_block_bitmap)
+    {
+        printk(KERN_ERR "assoofs_fill_super: unable to read the free space bitmaps\n");
+        ret = -EIO;
+        goto out_free;
+    }
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
-    root_inode = new_inode(sb);
-    inode_init_owner(sb->s_user_ns, root_inode, NULL, S_IFDIR);
-    root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode->i_sb = sb;
-    root_inode->i_op = &assoofs_inode_ops;
-    root_inode->i_fop = &assoofs_dir_operations;
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    root_inode = assoofs_get_inode(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    if (IS_ERR(root_inode))
+    {
+        printk(KERN_ERR "assoofs_fill_super: unable to read the root inode\n");
+        ret = PTR_ERR(root_inode);
+        goto out_free;
+    }
     sb->s_root = d_make_root(root_inode);
+    if (!sb->s_root)
+    {
+        ret = -ENOMEM;
+        goto out_free;
+    }
 
-    brelse(bh);
+    // Un huérfano que no se puede liberar solo ocupa sitio: se monta igualmente
+    if (assoofs_orphan_cleanup(sb))
+    {
+        printk(KERN_ERR "assoofs_fill_super: unable to free orphan inodes\n");
+    }
+
+    if (sbi->s_commit_interval && !assoofs_sync_mode(sb))
+    {
+        schedule_delayed_work(&sbi->s_commit_work, sbi->s_commit_interval * HZ);
+    }
     return 0;
+
+out_free:
+    // Si no se ha podido hacer el checkpoint lo confirmado sigue en el diario y se reproduce al montar
+    while (sbi->s_ckpt_count)
+    {
+        brelse(assoofs_ckpt_del(sbi, sbi->s_ckpt[0].live));
+    }
+    sb->s_fs_info = NULL;
+    assoofs_release_bitmap(sbi->s_inode_bitmap, sbi->s_as->inode_bitmap_blocks);
+    assoofs_release_bitmap(sbi->s_block_bitmap, sbi->s_as->block_bitmap_blocks);
+    kvfree(sbi->s_txn_buffers);
+    kvfree(sbi->s_txn_copies);
+    kvfree(sbi->s_journal_bhs);
+    kvfree(sbi->s_ckpt);
+    kvfree(sbi->s_revokes);
+    brelse(sbi->s_sbh);
+    crypto_free_shash(sbi->s_chksum_driver);
+    free_percpu(sbi->s_stats);
+    if (sbi->s_unwritten_wq)
+    {
+        destroy_workqueue(sbi->s_unwritten_wq);
+    }
+    kfree(sbi->s_as);
+    kfree(sbi);
+    return ret;
 }
 
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no)
+// Lee de la tabla de inodos la entrada inode_no en inode_info
+static int assoofs_read_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info)
 {
     // Paso 1
-    struct assoofs_inode_info *inode_info;
+    struct assoofs_inode_info *slot;
     struct buffer_head *bh;
-    struct assoofs_inode_info *buffer;
-    struct assoofs_super_block_info *afs_sb;
-    int i;
-    int resultMutexStorage;
 
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
+    slot = assoofs_inode_slot(sb, inode_no, &bh);
+    if (!slot)
+    {
+        return -EIO;
+    }
 
     // PASO 2
-    afs_sb = sb->s_fs_info;
-    for (i = 0; i < afs_sb->inodes_count; i++)
+    if (slot->inode_no != inode_no || !slot->mode)
     {
-        if (inode_info->inode_no == inode_no)
-        {
-            //buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-            resultMutexStorage = mutex_lock_interruptible(&assoofs_storageInodos_lock);
-            if(resultMutexStorage != 0){
-                printk(KERN_ERR "Ha habido un error en el mutex");
-            }
-            buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-            mutex_unlock(&assoofs_storageInodos_lock);
-            memcpy(buffer, inode_info, sizeof(*buffer));
-            break;
-        }
-        inode_info++;
+        printk(KERN_ERR "assoofs: inode %llu not found in the inode table\n", inode_no);
+        brelse(bh);
+        return -ENOENT;
     }
+    lock_buffer(bh);
+    memcpy(inode_info, slot, sizeof(*inode_info));
+    unlock_buffer(bh);
 
     // PASO 3
     brelse(bh);
-    return buffer;
+    if (inode_info->checksum != assoofs_inode_csum(sb, inode_info))
+    {
+        printk(KERN_ERR "assoofs: inode %llu checksum mismatch\n", inode_no);
+        return -EBADMSG;
+    }
+    return 0;
 }
 
 /*
@@ -742,15 +6120,138 @@ static struct file_system_type assoofs_type = {
     .kill_sb = kill_block_super,
 };
 
-int assoofs_destroy_inode(struct inode *inode)
+void assoofs_evict_inode(struct inode *inode)
 {
-    struct assoofs_inode *inode_info = inode->i_private;
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_handle *handle = NULL;
+    bool delete = !inode->i_nlink && !is_bad_inode(inode);
+
+    truncate_inode_pages_final(&inode->i_data);
+
+    // Último uso de un inodo ya borrado: ahora sí se liberan sus bloques y su entrada en la tabla
+    if (delete)
+    {
+        handle = assoofs_journal_start(sb, assoofs_truncate_credits(sb));
+        assoofs_free_extents(sb, inode_info);
+        if (inode_info->flags & ASSOOFS_INODE_ORPHAN)
+        {
+            spin_lock(&ASSOOFS_SB(sb)->s_lock);
+            ASSOOFS_SB(sb)->s_as->orphan_count--;
+            ASSOOFS_SB(sb)->s_sb_dirty = true;
+            spin_unlock(&ASSOOFS_SB(sb)->s_lock);
+        }
+        inode_info->mode = 0;
+        inode_info->flags = 0;
+        assoofs_save_inode_info(sb, inode_info);
+    }
+    clear_inode(inode);
+
+    if (delete)
+    {
+        assoofs_sb_set_a_freeinode(sb, inode->i_ino);
+        assoofs_journal_stop(handle);
+    }
+}
 
-    printk(KERN_INFO "Freeing private data of inode %p ( %lu)\n", inode_info, inode->i_ino);
+/*
+ * Al montar: los inodos que se quedaron huérfanos (sin nombres pero abiertos)
+ * cuando se cayó el sistema ya no los puede abrir nadie y se liberan. Solo se
+ * recorre la tabla si el superbloque dice que hay alguno.
+ */
+static int assoofs_orphan_cleanup(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_handle *handle;
+    unsigned int freed = 0;
+    uint64_t ino;
+    int ret = 0;
 
-    kmem_cache_free(assoofs_inode_cache, inode_info);
+    if (!sbi->s_as->orphan_count)
+    {
+        return 0;
+    }
+    inode_info = kmalloc(sizeof(*inode_info), GFP_KERNEL);
+    if (!inode_info)
+    {
+        return -ENOMEM;
+    }
 
-    return 0;
+    for (ino = ASSOOFS_LAST_RESERVED_INODE + 1; ino < sbi->s_as->max_inodes; ino++)
+    {
+        if (!assoofs_bitmap_test(sb, sbi->s_inode_bitmap, ino))
+        {
+            continue;
+        }
+        ret = assoofs_read_inode_info(sb, ino, inode_info);
+        if (ret)
+        {
+            break;
+        }
+        if (!(inode_info->flags & ASSOOFS_INODE_ORPHAN))
+        {
+            continue;
+        }
+
+        // Como en assoofs_evict_inode, un inodo por transacción
+        handle = assoofs_journal_start(sb, assoofs_truncate_credits(sb));
+        assoofs_free_extents(sb, inode_info);
+        inode_info->mode = 0;
+        inode_info->flags = 0;
+        assoofs_save_inode_info(sb, inode_info);
+        assoofs_sb_set_a_freeinode(sb, ino);
+        ret = assoofs_journal_stop(handle);
+        if (ret)
+        {
+            break;
+        }
+        freed++;
+    }
+    kfree(inode_info);
+
+    if (!ret)
+    {
+        handle = assoofs_journal_start(sb, ASSOOFS_JOURNAL_CREDITS);
+        spin_lock(&sbi->s_lock);
+        sbi->s_as->orphan_count = 0;
+        sbi->s_sb_dirty = true;
+        spin_unlock(&sbi->s_lock);
+        ret = assoofs_journal_stop(handle);
+    }
+    printk(KERN_INFO "assoofs: freed %u orphan inodes\n", freed);
+    return ret;
+}
+
+static struct inode *assoofs_alloc_inode(struct super_block *sb)
+{
+    struct assoofs_inode *ai;
+
+    ai = alloc_inode_sb(sb, assoofs_inode_cache, GFP_KERNEL);
+    if (!ai)
+    {
+        return NULL;
+    }
+    memset(&ai->info, 0, sizeof(ai->info));
+    ai->i_da_pages = 0;
+    atomic_set(&ai->i_unwritten_io, 0);
+    return &ai->vfs_inode;
+}
+
+static void assoofs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(assoofs_inode_cache, container_of(inode, struct assoofs_inode, vfs_inode));
+}
+
+// Constructor del slab: la parte de la VFS se inicializa una sola vez por objeto
+static void assoofs_init_once(void *foo)
+{
+    struct assoofs_inode *ai = foo;
+
+    init_rwsem(&ai->i_data_sem);
+    init_rwsem(&ai->i_writeback_sem);
+    mutex_init(&ai->i_cluster_mutex);
+    inode_init_once(&ai->vfs_inode);
 }
 
 static int __init assoofs_init(void)
@@ -758,8 +6259,10 @@ static int __init assoofs_init(void)
     int ret;
     printk(KERN_INFO "assoofs_init request\n");
 
+    BUILD_BUG_ON(sizeof(struct assoofs_inode_info) != ASSOOFS_INODE_SIZE);
+
     ret = register_filesystem(&assoofs_type);
-    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode_info), 0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
+    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode), 0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT), assoofs_init_once);
     if (ret != 0)
     {
         printk(KERN_ERR "Error registering assoofs\n");
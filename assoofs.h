@@ -1,40 +1,247 @@
 #define ASSOOFS_MAGIC 0x20200406
+#define ASSOOFS_VERSION 17
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
+#define ASSOOFS_MIN_BLOCK_SIZE 1024
+#define ASSOOFS_MAX_BLOCK_SIZE 65536
 #define ASSOOFS_FILENAME_MAXLEN 255
-#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER
 const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;  
-const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;  
-const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;     
 const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;     
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
 const int ASSOOFS_TRUE = 1;
 const int ASSOOFS_FALSE = 0;
 
+/*
+ * Tamaño de bloque: lo elige mkassoofs (potencia de dos entre
+ * ASSOOFS_MIN_BLOCK_SIZE y ASSOOFS_MAX_BLOCK_SIZE) y queda en block_size. Todo
+ * lo que depende de él se calcula con las macros de abajo a partir del tamaño
+ * de bloque bs del sistema de ficheros, no con ASSOOFS_DEFAULT_BLOCK_SIZE.
+ *
+ * Bloques de mapas de bits: un bit por inodo y otro por bloque del
+ * dispositivo (1 = ocupado), en orden little-endian. mkassoofs los dimensiona
+ * según el tamaño del dispositivo y los coloca justo detrás del superbloque;
+ * después vienen la tabla de inodos, el diario y los bloques de datos.
+ */
+#define ASSOOFS_BITS_PER_BLOCK(bs) ((uint64_t)(bs) * 8)
+
+/* El superbloque está al principio del bloque 0; el resto del bloque va a cero */
+
 struct assoofs_super_block_info {
     uint64_t version; 
     uint64_t magic;
     uint64_t block_size;    
-    uint64_t inodes_count;
-    uint64_t free_blocks;  
-    uint64_t free_inodes;
-    char padding[4048];     
+    uint64_t inodes_count;      /* inodos en uso */
+    uint64_t free_blocks;       /* número de bloques libres */
+    uint64_t free_inodes;       /* número de inodos libres */
+    uint64_t blocks_count;      /* bloques del dispositivo */
+    uint64_t max_inodes;        /* inodos que caben en la tabla de inodos */
+    uint64_t inode_bitmap_block;
+    uint64_t inode_bitmap_blocks;
+    uint64_t block_bitmap_block;
+    uint64_t block_bitmap_blocks;
+    uint64_t inode_table_block; /* el inodo n está en la posición n de la tabla */
+    uint64_t inode_table_blocks;
+    uint64_t first_data_block;
+    uint64_t journal_block;     /* diario de metadatos (ASSOOFS_JOURNAL_*) */
+    uint64_t journal_blocks;
+    uint64_t orphan_count;      /* inodos ASSOOFS_INODE_ORPHAN */
+    uint64_t checksum;          /* crc32c de los campos anteriores */
 };
 
+/*
+ * Sumas de comprobación: el superbloque, cada inodo de la tabla y cada bloque
+ * de directorio llevan un crc32c (sin invertir al final, empezando en ~0).
+ * El de un inodo se calcula sobre su registro con checksum a 0 y el de un
+ * bloque de directorio empieza por el número de inodo del directorio y cubre
+ * el bloque entero menos dt_checksum.
+ */
+#define ASSOOFS_CRC32C_SEED 0xffffffffU
+
+/*
+ * Entradas de directorio de longitud variable (como en ext2): cada bloque es
+ * una cadena de registros que lo cubren entero. rec_len es lo que ocupa el
+ * registro hasta el siguiente, y puede ser mayor que lo que necesita su nombre
+ * (el resto es hueco aprovechable). Un registro con inode_no 0 está libre. El
+ * nombre no termina en '\0'. file_type guarda el tipo del inodo para que
+ * readdir lo dé sin leerlo; sus valores son los FT_* del VFS.
+ */
 struct assoofs_dir_record_entry {
-    char filename[ASSOOFS_FILENAME_MAXLEN]; 
-    uint64_t inode_no; 
-    uint64_t entry_removed; 
+    uint32_t inode_no; 
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;  /* ASSOOFS_FT_* */
+    char filename[];
 };
 
+#define ASSOOFS_FT_UNKNOWN 0
+#define ASSOOFS_FT_REG_FILE 1
+#define ASSOOFS_FT_DIR 2
+
+#define ASSOOFS_DIR_REC_LEN(name_len) ((sizeof(struct assoofs_dir_record_entry) + (name_len) + 3) & ~3U)
+
+/*
+ * Final de cada bloque de directorio (hojas y raíz del índice): las entradas
+ * llegan hasta ASSOOFS_DIR_BLOCK_DATA(bs). dt_free es lo que queda libre en
+ * el bloque contando cada entrada en uso con ASSOOFS_DIR_REC_LEN de su nombre,
+ * esté el sitio libre junto o repartido entre los registros (en la raíz, 0).
+ */
+struct assoofs_dir_tail {
+    uint32_t dt_free;
+    uint32_t dt_checksum;
+};
+
+#define ASSOOFS_DIR_BLOCK_DATA(bs) ((bs) - sizeof(struct assoofs_dir_tail))
+
+
+/*
+ * Extents: rango de bloques lógicos consecutivos de un fichero que ocupan
+ * bloques físicos también consecutivos. Los primeros ASSOOFS_INODE_EXTENTS
+ * van dentro del propio inodo; el resto se guarda en un bloque de extents
+ * (extent_block) ordenados por ee_block. Un extent ASSOOFS_EXT_UNWRITTEN
+ * tiene sus bloques reservados (fallocate) pero todavía sin escribir: se lee
+ * como ceros sin ir al disco y pasa a normal al escribir en él.
+ *
+ * Un extent ASSOOFS_EXT_COMPRESSED guarda un cluster entero (los
+ * ASSOOFS_CLUSTER_BLOCKS bloques lógicos a partir de ee_block, que es
+ * múltiplo de ASSOOFS_CLUSTER_BLOCKS) comprimido con LZ4 en los ee_plen
+ * bloques físicos a partir de ee_start: una assoofs_cluster_header seguida de
+ * los datos comprimidos.
+ */
+#define ASSOOFS_INODE_EXTENTS 4
+
+#define ASSOOFS_EXT_UNWRITTEN 0x1
+#define ASSOOFS_EXT_COMPRESSED 0x2
+
+struct assoofs_extent {
+    uint32_t ee_block;  /* primer bloque lógico */
+    uint32_t ee_len;    /* número de bloques */
+    uint64_t ee_start;  /* primer bloque físico */
+    uint32_t ee_flags;  /* ASSOOFS_EXT_* */
+    uint32_t ee_plen;   /* bloques físicos de un extent comprimido */
+};
+
+#define ASSOOFS_CLUSTER_BLOCKS 4
+#define ASSOOFS_CLUSTER_MAGIC 0x41534c5a
+
+struct assoofs_cluster_header {
+    uint32_t ch_magic;
+    uint32_t ch_size;   /* bytes comprimidos detrás de la cabecera */
+    uint32_t ch_len;    /* bytes sin comprimir (menos que el cluster si acaba el fichero) */
+    uint32_t ch_reserved;
+};
+
+struct assoofs_extent_block {
+    uint64_t eb_count;
+    uint64_t eb_reserved;
+    struct assoofs_extent eb_extents[];
+};
+
+#define ASSOOFS_EXTENT_BLOCK_MAX(bs) (((bs) - sizeof(struct assoofs_extent_block)) / sizeof(struct assoofs_extent))
+#define ASSOOFS_MAX_EXTENTS(bs) (ASSOOFS_INODE_EXTENTS + ASSOOFS_EXTENT_BLOCK_MAX(bs))
+
+/*
+ * Cada inodo ocupa ASSOOFS_INODE_SIZE bytes en la tabla. Un fichero de hasta
+ * ASSOOFS_INLINE_DATA_MAX bytes guarda sus datos en el propio registro, en el
+ * sitio de los extents (ASSOOFS_INODE_INLINE, sin extents ni bloque de
+ * extents), y pasa a tener bloques cuando crece más.
+ */
+#define ASSOOFS_INODE_SIZE 256
+#define ASSOOFS_INLINE_DATA_MAX (ASSOOFS_INODE_SIZE - 40)
 
 struct assoofs_inode_info {
     mode_t mode;    
+    uint32_t extent_count;
     uint64_t inode_no; 
-    uint64_t data_block_number; 
 
     union {                
         uint64_t file_size;
         uint64_t dir_children_count;  
     };
+
+    uint32_t flags;         /* ASSOOFS_INODE_* */
+    uint32_t checksum;
+    uint64_t extent_block;
+    union {
+        struct assoofs_extent extents[ASSOOFS_INODE_EXTENTS];
+        char inline_data[ASSOOFS_INLINE_DATA_MAX];
+    };
+};
+
+#define ASSOOFS_INODES_PER_BLOCK(bs) ((bs) / sizeof(struct assoofs_inode_info))
+
+#define ASSOOFS_INODE_INDEXED 0x1   /* directorio con índice hash */
+#define ASSOOFS_INODE_INLINE 0x2    /* fichero con los datos en el inodo */
+#define ASSOOFS_INODE_COMPRESSED 0x4 /* fichero que se escribe en clusters comprimidos */
+#define ASSOOFS_INODE_ORPHAN 0x8    /* sin nombres pero todavía abierto: se libera al montar si queda así */
+#define ASSOOFS_INODE_UNWRITTEN 0x10 /* ha tenido extents sin escribir: sus páginas se vuelcan una a una */
+
+/*
+ * Directorios indexados: un directorio pequeño guarda sus entradas en un
+ * único bloque. Cuando ese bloque se llena, el bloque lógico 0 pasa a ser la
+ * raíz de un índice con pares (hash, bloque hoja) ordenados por hash y las
+ * entradas se reparten entre las hojas (bloques lógicos 1..dx_count). La hoja
+ * de dx_entries[i] guarda los nombres con hash en [hash_i, hash_i+1).
+ */
+#define ASSOOFS_DX_MAGIC 0x41534458
+
+struct assoofs_dx_entry {
+    uint32_t hash;
+    uint32_t block;     /* bloque lógico de la hoja */
+};
+
+struct assoofs_dx_root {
+    uint32_t dx_magic;
+    uint32_t dx_count;
+    uint64_t dx_reserved;
+    struct assoofs_dx_entry dx_entries[];
+};
+
+#define ASSOOFS_DX_MAX(bs) ((ASSOOFS_DIR_BLOCK_DATA(bs) - sizeof(struct assoofs_dx_root)) / sizeof(struct assoofs_dx_entry))
+#define ASSOOFS_DIR_RECORDS_PER_BLOCK(bs) (ASSOOFS_DIR_BLOCK_DATA(bs) / ASSOOFS_DIR_REC_LEN(1))
+
+/*
+ * Diario de metadatos: cada transacción se escribe en el diario antes de que
+ * sus bloques lleguen a su sitio. El primer bloque del diario es su
+ * superbloque (h_tid = primera transacción que hay que reproducir) y detrás
+ * van las transacciones una tras otra: uno o varios bloques descriptores con
+ * los números de bloque de destino, cada uno seguido de las copias de esos
+ * bloques, los bloques de revocación con los bloques liberados que ya no se
+ * deben reproducir desde transacciones anteriores, y un bloque de commit con
+ * el crc32 de todas las copias y revocaciones. Al montar se reproducen en
+ * orden las transacciones con el commit completo.
+ */
+#define ASSOOFS_JOURNAL_MAGIC 0x4153534a
+#define ASSOOFS_JOURNAL_MIN_BLOCKS 32
+
+enum {
+    ASSOOFS_JOURNAL_SUPER = 1,
+    ASSOOFS_JOURNAL_DESCRIPTOR = 2,
+    ASSOOFS_JOURNAL_COMMIT = 3,
+    ASSOOFS_JOURNAL_REVOKE = 4,     /* mismo formato que el descriptor */
+};
+
+struct assoofs_journal_header {
+    uint32_t h_magic;
+    uint32_t h_type;    /* ASSOOFS_JOURNAL_* */
+    uint32_t h_tid;     /* transacción */
+    uint32_t h_count;   /* bloques del descriptor o de toda la transacción */
+};
+
+struct assoofs_journal_descriptor {
+    struct assoofs_journal_header d_header;
+    uint64_t d_blocks[];
+};
+
+struct assoofs_journal_commit {
+    struct assoofs_journal_header c_header;
+    uint32_t c_crc;     /* crc32 de las copias y revocaciones de la transacción */
 };
+
+#define ASSOOFS_JOURNAL_TAGS(bs) (((bs) - sizeof(struct assoofs_journal_descriptor)) / sizeof(uint64_t))
+
+/*
+ * ioctl sobre un directorio: junta las hojas vecinas cuyas entradas caben en
+ * una, libera los bloques que sobran y, si queda una sola hoja, lo vuelve a
+ * dejar como directorio lineal.
+ */
+#define ASSOOFS_IOC_MAGIC 0xa5
+#define ASSOOFS_IOC_COMPACT_DIR _IO(ASSOOFS_IOC_MAGIC, 1)
@@ -0,0 +1,71 @@
+/*
+ * Tracepoints de assoofs: un evento por operación terminada (lectura,
+ * escritura, lookup, create, mkdir, unlink e iterate) con el inodo, la
+ * posición, la longitud pedida, el resultado y lo que ha tardado. Se activan
+ * en /sys/kernel/tracing/events/assoofs/ y no cuestan nada mientras están
+ * apagados.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM assoofs
+
+#if !defined(_ASSOOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASSOOFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_DEFINE_ENUM(ASSOOFS_OP_READ);
+TRACE_DEFINE_ENUM(ASSOOFS_OP_WRITE);
+TRACE_DEFINE_ENUM(ASSOOFS_OP_LOOKUP);
+TRACE_DEFINE_ENUM(ASSOOFS_OP_CREATE);
+TRACE_DEFINE_ENUM(ASSOOFS_OP_MKDIR);
+TRACE_DEFINE_ENUM(ASSOOFS_OP_UNLINK);
+TRACE_DEFINE_ENUM(ASSOOFS_OP_ITERATE);
+
+#define show_assoofs_op(op)                     \
+    __print_symbolic(op,                        \
+        { ASSOOFS_OP_READ, "read" },            \
+        { ASSOOFS_OP_WRITE, "write" },          \
+        { ASSOOFS_OP_LOOKUP, "lookup" },        \
+        { ASSOOFS_OP_CREATE, "create" },        \
+        { ASSOOFS_OP_MKDIR, "mkdir" },          \
+        { ASSOOFS_OP_UNLINK, "unlink" },        \
+        { ASSOOFS_OP_ITERATE, "iterate" })
+
+TRACE_EVENT(assoofs_op,
+    TP_PROTO(struct super_block *sb, int op, unsigned long ino, loff_t offset, size_t length, long result, u64 duration),
+
+    TP_ARGS(sb, op, ino, offset, length, result, duration),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(int, op)
+        __field(unsigned long, ino)
+        __field(loff_t, offset)
+        __field(size_t, length)
+        __field(long, result)
+        __field(u64, duration)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->op = op;
+        __entry->ino = ino;
+        __entry->offset = offset;
+        __entry->length = length;
+        __entry->result = result;
+        __entry->duration = duration;
+    ),
+
+    TP_printk("dev %d,%d op %s ino %lu offset %lld length %zu result %ld duration %llu ns",
+              MAJOR(__entry->dev), MINOR(__entry->dev), show_assoofs_op(__entry->op), __entry->ino,
+              __entry->offset, __entry->length, __entry->result, __entry->duration)
+);
+
+#endif /* _ASSOOFS_TRACE_H */
+
+/* Este fichero está fuera de include/trace/events: se busca junto al módulo (-I$(src) en el Makefile) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE assoofs_trace
+#include <trace/define_trace.h>
@@ -6,132 +6,284 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "assoofs.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
+#define ROOTDIR_DATABLOCK_NUMBER(sb) ((sb)->first_data_block)
 #define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
 
-static int write_superblock(int fd) {
-    struct assoofs_super_block_info sb = {
-        .version = 1,
-        .magic = ASSOOFS_MAGIC,
-        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
-        .inodes_count = WELCOMEFILE_INODE_NUMBER,
-        .free_blocks = (~0) & ~(15),
-        .free_inodes = (~0) & ~(7),
-    };
-    ssize_t ret;
+/* Un inodo por cada BLOCKS_PER_INODE bloques del dispositivo */
+#define BLOCKS_PER_INODE 4
+
+/* Un bloque de diario por cada BLOCKS_PER_JOURNAL_BLOCK, entre ASSOOFS_JOURNAL_MIN_BLOCKS y JOURNAL_MAX_BLOCKS */
+#define BLOCKS_PER_JOURNAL_BLOCK 32
+#define JOURNAL_MAX_BLOCKS 8192
+
+/* crc32c (Castagnoli) bit a bit, sin invertir al final: el mismo valor que calcula el módulo */
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    int i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82F63B78U & -(crc & 1));
+    }
+    return crc;
+}
+
+static void set_inode_checksum(struct assoofs_inode_info *inode) {
+    inode->checksum = 0;
+    inode->checksum = crc32c(ASSOOFS_CRC32C_SEED, inode, sizeof(*inode));
+}
+
+static int device_blocks(int fd, uint64_t block_size, uint64_t *blocks) {
+    struct stat st;
+    uint64_t bytes;
 
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading the device size");
         return -1;
     }
 
-    printf("Super block written succesfully.\n");
+    bytes = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &bytes) == -1) {
+        perror("Error reading the device size");
+        return -1;
+    }
+
+    *blocks = bytes / block_size;
     return 0;
 }
 
-static int write_root_inode(int fd) {
-    ssize_t ret;
+/*
+ * Reparte el dispositivo: superbloque, mapa de inodos, mapa de bloques,
+ * tabla de inodos (el inodo n ocupa la posición n), diario y, a
+ * continuación, los bloques de datos (el primero es el del directorio raíz;
+ * README.txt es pequeño y va en línea dentro de su inodo).
+ */
+static int compute_layout(struct assoofs_super_block_info *sb, uint64_t block_size, uint64_t blocks) {
+    uint64_t bits_per_block = ASSOOFS_BITS_PER_BLOCK(block_size);
+    uint64_t inodes_per_block = ASSOOFS_INODES_PER_BLOCK(block_size);
 
-    struct assoofs_inode_info root_inode;
+    memset(sb, 0, sizeof(*sb));
+    sb->version = ASSOOFS_VERSION;
+    sb->magic = ASSOOFS_MAGIC;
+    sb->block_size = block_size;
+    sb->inodes_count = WELCOMEFILE_INODE_NUMBER;
+    sb->blocks_count = blocks;
 
-    root_inode.mode = S_IFDIR;
-    root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
-    root_inode.dir_children_count = 1;
+    sb->max_inodes = blocks / BLOCKS_PER_INODE;
 
-    ret = write(fd, &root_inode, sizeof(root_inode));
+    sb->inode_bitmap_block = ASSOOFS_SUPERBLOCK_BLOCK_NUMBER + 1;
+    sb->inode_bitmap_blocks = (sb->max_inodes + bits_per_block - 1) / bits_per_block;
+    sb->block_bitmap_block = sb->inode_bitmap_block + sb->inode_bitmap_blocks;
+    sb->block_bitmap_blocks = (blocks + bits_per_block - 1) / bits_per_block;
+    sb->inode_table_block = sb->block_bitmap_block + sb->block_bitmap_blocks;
+    sb->inode_table_blocks = (sb->max_inodes + inodes_per_block - 1) / inodes_per_block;
+    sb->journal_block = sb->inode_table_block + sb->inode_table_blocks;
+    sb->journal_blocks = blocks / BLOCKS_PER_JOURNAL_BLOCK;
+    if (sb->journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS)
+        sb->journal_blocks = ASSOOFS_JOURNAL_MIN_BLOCKS;
+    if (sb->journal_blocks > JOURNAL_MAX_BLOCKS)
+        sb->journal_blocks = JOURNAL_MAX_BLOCKS;
+    sb->first_data_block = sb->journal_block + sb->journal_blocks;
 
-    if (ret != sizeof(root_inode)) {
-        printf("The inode store was not written properly.\n");
+    if (sb->max_inodes <= WELCOMEFILE_INODE_NUMBER || sb->first_data_block + 1 > blocks) {
+        printf("The device is too small (%llu blocks).\n", (unsigned long long)blocks);
         return -1;
     }
 
-    printf("root directory inode written succesfully.\n");
+    sb->free_inodes = sb->max_inodes - (WELCOMEFILE_INODE_NUMBER + 1);
+    sb->free_blocks = blocks - (sb->first_data_block + 1);
     return 0;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
-    off_t nbytes;
+/* El superbloque va al principio del bloque 0 y el resto del bloque a cero */
+static int write_superblock(int fd, struct assoofs_super_block_info *sb) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
     ssize_t ret;
 
-    ret = write(fd, i, sizeof(*i));
-    if (ret != sizeof(*i)) {
-        printf("The welcomefile inode was not written properly.\n");
+    sb->checksum = crc32c(ASSOOFS_CRC32C_SEED, sb, offsetof(struct assoofs_super_block_info, checksum));
+
+    memset(block, 0, sb->block_size);
+    memcpy(block, sb, sizeof(*sb));
+    ret = write(fd, block, sb->block_size);
+    if (ret != (ssize_t)sb->block_size) {
+        printf("Bytes written [%d] are not equal to the block size.\n", (int)ret);
         return -1;
     }
-    printf("welcomefile inode written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("The padding bytes are not written properly.\n");
-        return -1;
+    printf("Super block written succesfully.\n");
+    return 0;
+}
+
+static void fill_root_inode(struct assoofs_inode_info *root_inode, const struct assoofs_super_block_info *sb) {
+    memset(root_inode, 0, sizeof(*root_inode));
+    root_inode->mode = S_IFDIR;
+    root_inode->inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    root_inode->extent_count = 1;
+    root_inode->extents[0].ee_block = 0;
+    root_inode->extents[0].ee_len = 1;
+    root_inode->extents[0].ee_start = ROOTDIR_DATABLOCK_NUMBER(sb);
+    root_inode->dir_children_count = 1;
+    set_inode_checksum(root_inode);
+}
+
+/* Escribe la tabla de inodos entera: raíz y README.txt en su posición, el resto a cero */
+static int write_inode_table(int fd, const struct assoofs_super_block_info *sb, const struct assoofs_inode_info *welcome) {
+    struct assoofs_inode_info table[ASSOOFS_INODES_PER_BLOCK(ASSOOFS_MAX_BLOCK_SIZE)];
+    uint64_t i;
+    ssize_t ret;
+
+    for (i = 0; i < sb->inode_table_blocks; i++) {
+        memset(table, 0, sb->block_size);
+        if (i == 0) {
+            fill_root_inode(&table[ASSOOFS_ROOTDIR_INODE_NUMBER], sb);
+            table[WELCOMEFILE_INODE_NUMBER] = *welcome;
+            set_inode_checksum(&table[WELCOMEFILE_INODE_NUMBER]);
+        }
+
+        ret = write(fd, table, sb->block_size);
+        if (ret != (ssize_t)sb->block_size) {
+            printf("The inode table was not written properly.\n");
+            return -1;
+        }
     }
 
-    printf("inode store padding bytes (after two inodes) written sucessfully.\n");
+    printf("inode table (%llu blocks) written succesfully.\n", (unsigned long long)sb->inode_table_blocks);
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
-    ssize_t nbytes = sizeof(*record), ret;
+/*
+ * Escribe el diario vacío: su superbloque apunta a la transacción 1 y el
+ * resto va a cero para que no se reproduzca nada que quedara en el disco.
+ */
+static int write_journal(int fd, const struct assoofs_super_block_info *sb) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_journal_header *header = (struct assoofs_journal_header *)block;
+    uint64_t i;
+    ssize_t ret;
 
-    ret = write(fd, record, nbytes);
-    if (ret != nbytes) {
-        printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
-        return -1;
+    for (i = 0; i < sb->journal_blocks; i++) {
+        memset(block, 0, sb->block_size);
+        if (i == 0) {
+            header->h_magic = ASSOOFS_JOURNAL_MAGIC;
+            header->h_type = ASSOOFS_JOURNAL_SUPER;
+            header->h_tid = 1;
+        }
+
+        ret = write(fd, block, sb->block_size);
+        if (ret != (ssize_t)sb->block_size) {
+            printf("Writing the journal has failed.\n");
+            return -1;
+        }
     }
-    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
-        return -1;
+    printf("journal (%llu blocks) written succesfully.\n", (unsigned long long)sb->journal_blocks);
+    return 0;
+}
+
+/* Marca como ocupados los primeros used bits y escribe nblocks bloques de mapa */
+static int write_bitmap(int fd, uint64_t block_size, uint64_t nblocks, uint64_t used) {
+    unsigned char block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t bits_per_block = ASSOOFS_BITS_PER_BLOCK(block_size);
+    uint64_t i, bit;
+    ssize_t ret;
+
+    for (i = 0; i < nblocks; i++) {
+        memset(block, 0, block_size);
+        for (bit = i * bits_per_block; bit < used && bit < (i + 1) * bits_per_block; bit++)
+            block[(bit % bits_per_block) / 8] |= 1 << (bit % 8);
+
+        ret = write(fd, block, block_size);
+        if (ret != (ssize_t)block_size) {
+            printf("Writing the free space bitmaps has failed.\n");
+            return -1;
+        }
     }
-    printf("Padding after the rootdirectory children written succesfully.\n");
     return 0;
 }
 
-int write_block(int fd, char *block, size_t len) {
+static int write_bitmaps(int fd, const struct assoofs_super_block_info *sb) {
+    /* Inodos 0 (sin usar), raíz y README.txt */
+    if (write_bitmap(fd, sb->block_size, sb->inode_bitmap_blocks, WELCOMEFILE_INODE_NUMBER + 1))
+        return -1;
+
+    /* Metadatos y bloque del directorio raíz */
+    if (write_bitmap(fd, sb->block_size, sb->block_bitmap_blocks, sb->first_data_block + 1))
+        return -1;
+
+    printf("inode and block bitmaps written succesfully.\n");
+    return 0;
+}
+
+int write_dirent(int fd, uint64_t block_size, const char *name, uint32_t inode_no, uint8_t file_type) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)block;
+    struct assoofs_dir_tail *tail = (struct assoofs_dir_tail *)(block + ASSOOFS_DIR_BLOCK_DATA(block_size));
+    uint64_t dir_ino = ASSOOFS_ROOTDIR_INODE_NUMBER;
     ssize_t ret;
 
-    ret = write(fd, block, len);
-    if (ret != len) {
-        printf("Writing file body has failed.\n");
+    /* Una sola entrada cuyo registro ocupa el bloque entero hasta la cola */
+    memset(block, 0, block_size);
+    record->inode_no = inode_no;
+    record->rec_len = ASSOOFS_DIR_BLOCK_DATA(block_size);
+    record->name_len = strlen(name);
+    record->file_type = file_type;
+    memcpy(record->filename, name, record->name_len);
+    tail->dt_free = ASSOOFS_DIR_BLOCK_DATA(block_size) - ASSOOFS_DIR_REC_LEN(record->name_len);
+    tail->dt_checksum = crc32c(crc32c(ASSOOFS_CRC32C_SEED, &dir_ino, sizeof(dir_ino)), block, block_size - sizeof(uint32_t));
+
+    ret = write(fd, block, block_size);
+    if (ret != (ssize_t)block_size) {
+        printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
         return -1;
     }
-    printf("block has been written succesfully.\n");
+    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
     return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    int fd;
+    int fd, opt;
     ssize_t ret;
+    uint64_t blocks;
+    uint64_t block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    char *end;
+    struct assoofs_super_block_info sb;
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
     
     struct assoofs_inode_info welcome = {
         .mode = S_IFREG,
         .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
+        .flags = ASSOOFS_INODE_INLINE,
         .file_size = sizeof(welcomefile_body),
     };
-    
-    struct assoofs_dir_record_entry record = {
-        .filename = "README.txt",
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .entry_removed = ASSOOFS_FALSE
-    };
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = strtoull(optarg, &end, 10);
+            if (*end || block_size < ASSOOFS_MIN_BLOCK_SIZE || block_size > ASSOOFS_MAX_BLOCK_SIZE || (block_size & (block_size - 1))) {
+                printf("The block size must be a power of two between %d and %d.\n", ASSOOFS_MIN_BLOCK_SIZE, ASSOOFS_MAX_BLOCK_SIZE);
+                return -1;
+            }
+            break;
+        default:
+            printf("Usage: mkassoofs [-b block_size] <device>\n");
+            return -1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        printf("Usage: mkassoofs [-b block_size] <device>\n");
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR);
+    fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("Error opening the device");
         return -1;
@@ -139,19 +291,27 @@ int main(int argc, char *argv[])
 
     ret = 1;
     do {
-        if (write_superblock(fd))
+        if (device_blocks(fd, block_size, &blocks))
             break;
 
-        if (write_root_inode(fd))
+        if (compute_layout(&sb, block_size, blocks))
             break;
-        
-        if (write_welcome_inode(fd, &welcome))
+
+        memcpy(welcome.inline_data, welcomefile_body, welcome.file_size);
+
+        if (write_superblock(fd, &sb))
+            break;
+
+        if (write_bitmaps(fd, &sb))
             break;
 
-        if (write_dirent(fd, &record))
+        if (write_inode_table(fd, &sb, &welcome))
             break;
-        
-        if (write_block(fd, welcomefile_body, welcome.file_size))
+
+        if (write_journal(fd, &sb))
+            break;
+
+        if (write_dirent(fd, block_size, "README.txt", WELCOMEFILE_INODE_NUMBER, ASSOOFS_FT_REG_FILE))
             break;
 
         ret = 0;